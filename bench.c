@@ -0,0 +1,605 @@
+/*
+   Copyright (C) 2022 Con Kolivas
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Benchmark harness run by make bench. Generates deterministic synthetic
+ * corpora and times compression and decompression of each across a matrix
+ * of backends, levels, windows and thread counts. Every job runs in its own
+ * child process so the peak resident memory of each can be measured. Results
+ * are written as CSV or JSON, and can be compared against a stored CSV
+ * baseline to flag regressions. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <limits.h>
+
+#include "lrzip_core.h"
+#include "util.h"
+#include "stats.h"
+/* needed for CRC routines */
+#include "lzma/C/7zCrc.h"
+
+#define MAX_LIST	16
+#define WORDS		2048
+#define VM_PAGE		4096
+
+struct bench_result {
+	char corpus[32];
+	int size_mb;
+	char backend[16];
+	int level;
+	int window;
+	int threads;
+	double comp_time;
+	double comp_mbps;
+	double decomp_time;
+	double decomp_mbps;
+	double ratio;
+	long comp_rss;
+	long decomp_rss;
+};
+
+static const struct {
+	const char *name;
+	unsigned long flags;
+} backends[] = {
+	{ "lzma", 0 },
+	{ "lzo", FLAG_LZO_COMPRESS },
+	{ "gzip", FLAG_ZLIB_COMPRESS },
+	{ "bzip2", FLAG_BZIP2_COMPRESS },
+	{ "zpaq", FLAG_ZPAQ_COMPRESS },
+	{ "none", FLAG_NO_COMPRESS },
+};
+
+static const char *corpora[] = { "random", "text", "zero", "longrange", "vm" };
+
+static uint64_t rng_state;
+
+static void die(const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	exit(1);
+}
+
+/* xorshift64* so every corpus is identical across runs and machines */
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ull;
+}
+
+static void gen_random(uchar *buf, i64 len)
+{
+	i64 i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t r = rng();
+
+		memcpy(buf + i, &r, 8);
+	}
+	for (; i < len; i++)
+		buf[i] = rng();
+}
+
+static char words[WORDS][16];
+
+static void gen_words(void)
+{
+	static const char *syllables[] = {
+		"an", "ber", "con", "de", "en", "for", "ga", "ing", "is", "ka",
+		"le", "mo", "ne", "or", "pre", "qu", "re", "st", "the", "un",
+		"ver", "wa", "xi", "yo", "ze", "al", "th", "er", "ou", "ly"
+	};
+	int i, j, n;
+
+	for (i = 0; i < WORDS; i++) {
+		words[i][0] = '\0';
+		n = 1 + rng() % 4;
+		for (j = 0; j < n; j++)
+			strcat(words[i], syllables[rng() % 30]);
+	}
+}
+
+/* Words picked with a skewed distribution so a few are very common, as in
+ * natural language, broken into lines with some punctuation */
+static void gen_text(uchar *buf, i64 len)
+{
+	i64 i = 0, line = 0;
+
+	while (i < len) {
+		uint64_t r = rng();
+		const char *word = words[((r & 0x7ff) * ((r >> 11) & 0x7ff)) >> 11];
+		int wlen = strlen(word);
+
+		if (i + wlen + 1 > len)
+			wlen = len - i - 1;
+		memcpy(buf + i, word, MAX(wlen, 0));
+		i += MAX(wlen, 0);
+		line += wlen + 1;
+		if (line > 72) {
+			buf[i++] = '\n';
+			line = 0;
+		} else if (!((r >> 24) & 0xf))
+			buf[i++] = (r >> 28) & 1 ? ',' : '.';
+		else
+			buf[i++] = ' ';
+	}
+}
+
+/* Random data where everything after the first distance bytes repeats the
+ * data distance bytes earlier with a sprinkling of changes, so only a
+ * match finder that can reach that far back will find the redundancy */
+static void gen_longrange(uchar *buf, i64 len, i64 distance)
+{
+	i64 i;
+
+	if (distance < 1 || distance > len)
+		distance = len / 2;
+	gen_random(buf, distance);
+	for (i = distance; i < len; i++) {
+		buf[i] = buf[i - distance];
+		if (!(i & 4095))
+			buf[i] = rng();
+	}
+}
+
+/* Resembles a virtual machine disk image: unallocated zero pages, the same
+ * library and kernel pages duplicated throughout, text such as logs and
+ * configuration, and already compressed data */
+static void gen_vm(uchar *buf, i64 len)
+{
+	i64 i, pool = 0, pool_max = len / VM_PAGE / 16;
+	i64 *pages;
+
+	pages = calloc(sizeof(i64), pool_max + 1);
+	if (!pages)
+		die("Failed to calloc pages in gen_vm\n");
+	for (i = 0; i < len; i += VM_PAGE) {
+		i64 plen = MIN(VM_PAGE, len - i);
+		int type = rng() % 100;
+
+		if (type < 35)
+			memset(buf + i, 0, plen);
+		else if (type < 55 && pool)
+			memcpy(buf + i, buf + pages[rng() % pool], plen);
+		else if (type < 80)
+			gen_text(buf + i, plen);
+		else
+			gen_random(buf + i, plen);
+		if (type >= 55 && plen == VM_PAGE && pool < pool_max && !(rng() % 4))
+			pages[pool++] = i;
+	}
+	free(pages);
+}
+
+static bool gen_corpus(const char *corpus, const char *path, i64 len, i64 distance, uint64_t seed)
+{
+	uchar *buf;
+	bool ret;
+	int fd;
+
+	buf = malloc(len);
+	if (!buf)
+		return false;
+	rng_state = seed ? seed : 1;
+	gen_words();
+	if (!strcmp(corpus, "random"))
+		gen_random(buf, len);
+	else if (!strcmp(corpus, "text"))
+		gen_text(buf, len);
+	else if (!strcmp(corpus, "zero"))
+		memset(buf, 0, len);
+	else if (!strcmp(corpus, "longrange"))
+		gen_longrange(buf, len, distance);
+	else
+		gen_vm(buf, len);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		free(buf);
+		return false;
+	}
+	ret = write(fd, buf, len) == len;
+	close(fd);
+	free(buf);
+	return ret;
+}
+
+static bool same_files(const char *a, const char *b)
+{
+	FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+	bool ret = fa && fb;
+	int ca, cb;
+
+	while (ret) {
+		ca = getc(fa);
+		cb = getc(fb);
+		if (ca != cb)
+			ret = false;
+		if (ca == EOF || cb == EOF)
+			break;
+	}
+	if (fa)
+		fclose(fa);
+	if (fb)
+		fclose(fb);
+	return ret;
+}
+
+/* Run one compression or decompression in a child process, returning its
+ * wall time and peak resident memory in kilobytes */
+static bool run_job(unsigned long flags, int level, int window, int threads,
+		    char *infile, char *outname, double *seconds, long *rss)
+{
+	struct rusage ru;
+	double start;
+	int status;
+	pid_t pid;
+
+	fflush(NULL);
+	start = stats_time();
+	pid = fork();
+	if (pid == -1)
+		return false;
+	if (!pid) {
+		rzip_control control;
+		bool ret;
+
+		memset(&control, 0, sizeof(control));
+		if (!initialise_control(&control))
+			_exit(1);
+		control.flags &= ~FLAG_SHOW_PROGRESS;
+		control.flags |= FLAG_FORCE_REPLACE | flags;
+		control.msgout = NULL;
+		if (level)
+			control.compression_level = level;
+		if (window)
+			control.window = window;
+		if (threads)
+			control.threads = threads;
+		control.infile = infile;
+		control.outname = outname;
+		setup_overhead(&control);
+		setup_ram(&control);
+		if (flags & FLAG_DECOMPRESS)
+			ret = decompress_file(&control);
+		else
+			ret = compress_file(&control);
+		_exit(!ret);
+	}
+	if (wait4(pid, &status, 0, &ru) != pid)
+		return false;
+	*seconds = stats_time() - start;
+	*rss = ru.ru_maxrss;
+	return WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+static int split_list(char *arg, char **list)
+{
+	char *tok, *save = NULL;
+	int n = 0;
+
+	for (tok = strtok_r(arg, ",", &save); tok && n < MAX_LIST; tok = strtok_r(NULL, ",", &save))
+		list[n++] = tok;
+	return n;
+}
+
+static int split_ints(char *arg, int *list)
+{
+	char *strs[MAX_LIST];
+	int i, n = split_list(arg, strs);
+
+	for (i = 0; i < n; i++)
+		list[i] = atoi(strs[i]);
+	return n;
+}
+
+static void print_header(FILE *out, bool json)
+{
+	if (json)
+		fprintf(out, "[\n");
+	else
+		fprintf(out, "corpus,size_mb,backend,level,window,threads,compress_seconds,"
+			"compress_mbps,decompress_seconds,decompress_mbps,ratio,"
+			"compress_rss_kb,decompress_rss_kb\n");
+}
+
+static void print_result(FILE *out, bool json, bool first, const struct bench_result *r)
+{
+	if (json)
+		fprintf(out, "%s{\"corpus\":\"%s\",\"size_mb\":%d,\"backend\":\"%s\",\"level\":%d,"
+			"\"window\":%d,\"threads\":%d,\"compress_seconds\":%.3f,\"compress_mbps\":%.2f,"
+			"\"decompress_seconds\":%.3f,\"decompress_mbps\":%.2f,\"ratio\":%.3f,"
+			"\"compress_rss_kb\":%ld,\"decompress_rss_kb\":%ld}",
+			first ? "" : ",\n", r->corpus, r->size_mb, r->backend, r->level, r->window,
+			r->threads, r->comp_time, r->comp_mbps, r->decomp_time, r->decomp_mbps,
+			r->ratio, r->comp_rss, r->decomp_rss);
+	else
+		fprintf(out, "%s,%d,%s,%d,%d,%d,%.3f,%.2f,%.3f,%.2f,%.3f,%ld,%ld\n",
+			r->corpus, r->size_mb, r->backend, r->level, r->window, r->threads,
+			r->comp_time, r->comp_mbps, r->decomp_time, r->decomp_mbps, r->ratio,
+			r->comp_rss, r->decomp_rss);
+	fflush(out);
+}
+
+static struct bench_result *load_baseline(const char *path, int *n)
+{
+	struct bench_result *base = NULL, r;
+	char line[512];
+	FILE *f;
+
+	*n = 0;
+	f = fopen(path, "r");
+	if (!f)
+		die("Failed to open baseline %s\n", path);
+	while (fgets(line, sizeof(line), f)) {
+		memset(&r, 0, sizeof(r));
+		if (sscanf(line, "%31[^,],%d,%15[^,],%d,%d,%d,%lf,%lf,%lf,%lf,%lf,%ld,%ld",
+			   r.corpus, &r.size_mb, r.backend, &r.level, &r.window, &r.threads,
+			   &r.comp_time, &r.comp_mbps, &r.decomp_time, &r.decomp_mbps,
+			   &r.ratio, &r.comp_rss, &r.decomp_rss) != 13)
+			continue;
+		base = realloc(base, sizeof(r) * (*n + 1));
+		if (!base)
+			die("Failed to realloc baseline\n");
+		base[(*n)++] = r;
+	}
+	fclose(f);
+	return base;
+}
+
+/* Speed and memory may vary by threshold percent from the baseline, but the
+ * ratio is deterministic so any real loss of compression is flagged */
+static int compare_baseline(const struct bench_result *r, const struct bench_result *base,
+			    int nbase, double threshold)
+{
+	double slack = threshold / 100;
+	int i, regressions = 0;
+
+	for (i = 0; i < nbase; i++) {
+		const struct bench_result *b = &base[i];
+
+		if (strcmp(r->corpus, b->corpus) || strcmp(r->backend, b->backend) ||
+		    r->size_mb != b->size_mb || r->level != b->level ||
+		    r->window != b->window || r->threads != b->threads)
+			continue;
+		if (r->comp_mbps < b->comp_mbps * (1 - slack)) {
+			fprintf(stderr, "REGRESSION %s %s L%d: compression %.2f MB/s vs baseline %.2f MB/s\n",
+				r->corpus, r->backend, r->level, r->comp_mbps, b->comp_mbps);
+			regressions++;
+		}
+		if (r->decomp_mbps < b->decomp_mbps * (1 - slack)) {
+			fprintf(stderr, "REGRESSION %s %s L%d: decompression %.2f MB/s vs baseline %.2f MB/s\n",
+				r->corpus, r->backend, r->level, r->decomp_mbps, b->decomp_mbps);
+			regressions++;
+		}
+		if (r->ratio < b->ratio * 0.99) {
+			fprintf(stderr, "REGRESSION %s %s L%d: ratio %.3f vs baseline %.3f\n",
+				r->corpus, r->backend, r->level, r->ratio, b->ratio);
+			regressions++;
+		}
+		if (r->comp_rss > b->comp_rss * (1 + slack) ||
+		    r->decomp_rss > b->decomp_rss * (1 + slack)) {
+			fprintf(stderr, "REGRESSION %s %s L%d: peak rss %ld/%ld kB vs baseline %ld/%ld kB\n",
+				r->corpus, r->backend, r->level, r->comp_rss, r->decomp_rss,
+				b->comp_rss, b->decomp_rss);
+			regressions++;
+		}
+		break;
+	}
+	return regressions;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"	-c list		corpora (default random,text,zero,longrange,vm)\n"
+		"	-b list		backends from lzma,lzo,gzip,bzip2,zpaq,none (default lzo,gzip,bzip2,lzma)\n"
+		"	-L list		compression levels (default 7)\n"
+		"	-w list		windows in hundreds of MB, 0 for heuristic (default 0)\n"
+		"	-p list		thread counts, 0 for all cpus (default 0)\n"
+		"	-s size		corpus size in MB (default 32)\n"
+		"	-d distance	longrange repeat distance in MB (default half the size)\n"
+		"	-S seed		corpus seed (default 1)\n"
+		"	-r repeats	best of this many runs of each job (default 1)\n"
+		"	-f csv|json	output format (default csv)\n"
+		"	-o file		write results to file instead of stdout\n"
+		"	-B file		compare against a baseline CSV from a previous run\n"
+		"	-t percent	speed and memory regression threshold (default 10)\n"
+		"	-T dir		directory for temporary files (default .)\n"
+		"Each list is comma separated.\n", name);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	char *corpus_list[MAX_LIST], *backend_list[MAX_LIST];
+	char corpus_arg[256] = "random,text,zero,longrange,vm", backend_arg[256] = "lzo,gzip,bzip2,lzma";
+	char level_arg[64] = "7", window_arg[64] = "0", thread_arg[64] = "0";
+	int levels[MAX_LIST], windows[MAX_LIST], threads[MAX_LIST];
+	int ncorpora, nbackends, nlevels, nwindows, nthreads;
+	int size_mb = 32, distance_mb = 0, repeats = 1, nbase = 0, regressions = 0, failures = 0;
+	int c, ci, bi, li, wi, ti, rep;
+	struct bench_result *base = NULL;
+	const char *tmpdir = ".";
+	double threshold = 10;
+	FILE *out = stdout;
+	bool json = false, first = true;
+	uint64_t seed = 1;
+
+	while ((c = getopt(argc, argv, "c:b:L:w:p:s:d:S:r:f:o:B:t:T:h")) != -1) {
+		switch (c) {
+		case 'c':
+			strncpy(corpus_arg, optarg, sizeof(corpus_arg) - 1);
+			break;
+		case 'b':
+			strncpy(backend_arg, optarg, sizeof(backend_arg) - 1);
+			break;
+		case 'L':
+			strncpy(level_arg, optarg, sizeof(level_arg) - 1);
+			break;
+		case 'w':
+			strncpy(window_arg, optarg, sizeof(window_arg) - 1);
+			break;
+		case 'p':
+			strncpy(thread_arg, optarg, sizeof(thread_arg) - 1);
+			break;
+		case 's':
+			size_mb = atoi(optarg);
+			break;
+		case 'd':
+			distance_mb = atoi(optarg);
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			repeats = atoi(optarg);
+			break;
+		case 'f':
+			json = !strcmp(optarg, "json");
+			break;
+		case 'o':
+			out = fopen(optarg, "w");
+			if (!out)
+				die("Failed to create %s\n", optarg);
+			break;
+		case 'B':
+			base = load_baseline(optarg, &nbase);
+			break;
+		case 't':
+			threshold = atof(optarg);
+			break;
+		case 'T':
+			tmpdir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	ncorpora = split_list(corpus_arg, corpus_list);
+	nbackends = split_list(backend_arg, backend_list);
+	nlevels = split_ints(level_arg, levels);
+	nwindows = split_ints(window_arg, windows);
+	nthreads = split_ints(thread_arg, threads);
+	if (size_mb < 1 || repeats < 1 || !ncorpora || !nbackends || !nlevels || !nwindows || !nthreads)
+		usage(argv[0]);
+
+	CrcGenerateTable();
+	print_header(out, json);
+
+	for (ci = 0; ci < ncorpora; ci++) {
+		char infile[PATH_MAX], lrzfile[PATH_MAX + 8], outfile[PATH_MAX + 8];
+		i64 len = (i64)size_mb * 1024 * 1024;
+		struct stat st;
+
+		for (c = 0; c < (int)(sizeof(corpora) / sizeof(corpora[0])); c++)
+			if (!strcmp(corpus_list[ci], corpora[c]))
+				break;
+		if (c == sizeof(corpora) / sizeof(corpora[0])) {
+			fprintf(stderr, "Unknown corpus %s\n", corpus_list[ci]);
+			usage(argv[0]);
+		}
+		snprintf(infile, sizeof(infile), "%s/bench.%s", tmpdir, corpus_list[ci]);
+		snprintf(lrzfile, sizeof(lrzfile), "%s.lrz", infile);
+		snprintf(outfile, sizeof(outfile), "%s.out", infile);
+		if (!gen_corpus(corpus_list[ci], infile, len, (i64)distance_mb * 1024 * 1024, seed + c))
+			die("Failed to write corpus %s\n", infile);
+
+		for (bi = 0; bi < nbackends; bi++) {
+			unsigned long flags = ~0ul;
+
+			for (c = 0; c < (int)(sizeof(backends) / sizeof(backends[0])); c++)
+				if (!strcmp(backend_list[bi], backends[c].name))
+					flags = backends[c].flags;
+			if (flags == ~0ul) {
+				fprintf(stderr, "Unknown backend %s\n", backend_list[bi]);
+				usage(argv[0]);
+			}
+			for (li = 0; li < nlevels; li++)
+			for (wi = 0; wi < nwindows; wi++)
+			for (ti = 0; ti < nthreads; ti++) {
+				struct bench_result r;
+				bool ok = true;
+
+				memset(&r, 0, sizeof(r));
+				strcpy(r.corpus, corpus_list[ci]);
+				strncpy(r.backend, backend_list[bi], sizeof(r.backend) - 1);
+				r.size_mb = size_mb;
+				r.level = levels[li];
+				r.window = windows[wi];
+				r.threads = threads[ti];
+				r.comp_time = r.decomp_time = 1e9;
+				for (rep = 0; rep < repeats && ok; rep++) {
+					double secs;
+					long rss;
+
+					ok = run_job(flags, r.level, r.window, r.threads, infile, lrzfile, &secs, &rss);
+					r.comp_time = MIN(r.comp_time, secs);
+					r.comp_rss = MAX(r.comp_rss, rss);
+					if (ok)
+						ok = run_job(FLAG_DECOMPRESS, 0, 0, r.threads, lrzfile, outfile, &secs, &rss);
+					r.decomp_time = MIN(r.decomp_time, secs);
+					r.decomp_rss = MAX(r.decomp_rss, rss);
+					if (ok)
+						ok = same_files(infile, outfile);
+				}
+				if (!ok || stat(lrzfile, &st)) {
+					fprintf(stderr, "FAILED %s %s L%d w%d p%d did not round trip\n",
+						r.corpus, r.backend, r.level, r.window, r.threads);
+					failures++;
+					continue;
+				}
+				r.comp_mbps = len / 1048576.0 / MAX(r.comp_time, 0.001);
+				r.decomp_mbps = len / 1048576.0 / MAX(r.decomp_time, 0.001);
+				r.ratio = st.st_size ? (double)len / st.st_size : 0;
+				print_result(out, json, first, &r);
+				first = false;
+				if (base)
+					regressions += compare_baseline(&r, base, nbase, threshold);
+			}
+		}
+		unlink(infile);
+		unlink(lrzfile);
+		unlink(outfile);
+	}
+	if (json)
+		fprintf(out, "\n]\n");
+	fflush(out);
+	if (out != stdout)
+		fclose(out);
+	free(base);
+	if (base || nbase)
+		fprintf(stderr, "%d regressions against baseline\n", regressions);
+	return failures || regressions;
+}
@@ -45,18 +45,32 @@
 #ifdef HAVE_ARPA_INET_H
 # include <arpa/inet.h>
 #endif
+#include <limits.h>
 #include <math.h>
 #include <utime.h>
 #include <inttypes.h>
+#ifdef __linux
+# include <sched.h>
+#endif
 
 #include "md5.h"
 #include "rzip.h"
 #include "runzip.h"
 #include "util.h"
 #include "stream.h"
+#include "stats.h"
+#include "numa.h"
+#include "throttle.h"
+#include "tune.h"
 
 #define MAGIC_LEN (24)
+#define MAGIC_ENCRYPTED (1) // bits of magic[22]
+#define MAGIC_HOLES (2)
 #define STDIO_TMPFILE_BUFFER_SIZE (65536) // used in read_tmpinfile and dump_tmpoutfile
+#define ESTIMATE_SAMPLES (8) // samples of the input for --estimate backend trials
+#define ESTIMATE_SAMPLE_LEN (1024 * 1024)
+#define ESTIMATE_RUN (16) // contiguous pages per sample run
+#define PREALLOC_RATIO (2) // compression ratio assumed when reserving space for output
 
 static void release_hashes(rzip_control *control);
 
@@ -146,6 +160,134 @@ i64 get_ram(rzip_control *control)
 }
 #endif
 
+#ifdef __linux
+/* CPUs worth of time allowed by the cpu controller quota in dir, 0 if none */
+static double read_cpu_quota(const char *dir, bool v2)
+{
+	long long quota = -1, period = 0;
+	char path[PATH_MAX * 2], buf[64];
+	FILE *f;
+
+	if (v2) {
+		snprintf(path, sizeof(path), "%s/cpu.max", dir);
+		if (!(f = fopen(path, "r")))
+			return 0;
+		/* "max 100000" when unlimited, else "quota period" */
+		if (fgets(buf, sizeof(buf), f) && strncmp(buf, "max", 3))
+			sscanf(buf, "%lld %lld", &quota, &period);
+		fclose(f);
+	} else {
+		snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+		if (!(f = fopen(path, "r")))
+			return 0;
+		if (fscanf(f, "%lld", &quota) != 1)
+			quota = -1;
+		fclose(f);
+		snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+		if (!(f = fopen(path, "r")))
+			return 0;
+		if (fscanf(f, "%lld", &period) != 1)
+			period = 0;
+		fclose(f);
+	}
+	if (quota <= 0 || period <= 0)
+		return 0;
+	return (double)quota / period;
+}
+
+/* A quota may be set on any ancestor of our cgroup so walk up to the root of
+ * the hierarchy mounted at mount taking the tightest */
+static double walk_cpu_quota(const char *mount, const char *cgroup, bool v2)
+{
+	char cgpath[PATH_MAX], dir[PATH_MAX + 64];
+	double quota = 0, q;
+	char *slash;
+
+	snprintf(cgpath, sizeof(cgpath), "%s", cgroup);
+	while (42) {
+		snprintf(dir, sizeof(dir), "%s%s", mount, cgpath);
+		q = read_cpu_quota(dir, v2);
+		if (q > 0 && (!quota || q < quota))
+			quota = q;
+		slash = strrchr(cgpath, '/');
+		if (!slash || (slash == cgpath && !cgpath[1]))
+			break;
+		if (slash == cgpath)
+			cgpath[1] = '\0';
+		else
+			*slash = '\0';
+	}
+	return quota;
+}
+
+/* The CPU quota of our cgroup, as in a container, in CPUs or 0 if none. Our
+ * cgroup comes from /proc/self/cgroup where v1 hierarchies are listed as
+ * id:controllers:path and the v2 unified hierarchy as 0::path. */
+static double cgroup_cpu_quota(void)
+{
+	char line[PATH_MAX], v1[PATH_MAX] = "", v2[PATH_MAX] = "";
+	double quota = 0, q;
+	FILE *f;
+
+	if (!(f = fopen("/proc/self/cgroup", "r")))
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		char *ctrls, *cgpath, *tok, *save;
+
+		line[strcspn(line, "\n")] = '\0';
+		if (!(ctrls = strchr(line, ':')) || !(cgpath = strchr(++ctrls, ':')))
+			continue;
+		*cgpath++ = '\0';
+		if (!*ctrls) {
+			snprintf(v2, sizeof(v2), "%s", cgpath);
+			continue;
+		}
+		for (tok = strtok_r(ctrls, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+			if (!strcmp(tok, "cpu"))
+				snprintf(v1, sizeof(v1), "%s", cgpath);
+		}
+	}
+	fclose(f);
+	if (*v1) {
+		quota = walk_cpu_quota("/sys/fs/cgroup/cpu,cpuacct", v1, false);
+		if (!quota)
+			quota = walk_cpu_quota("/sys/fs/cgroup/cpu", v1, false);
+	}
+	if (*v2) {
+		q = walk_cpu_quota("/sys/fs/cgroup", v2, true);
+		if (q > 0 && (!quota || q < quota))
+			quota = q;
+	}
+	return quota;
+}
+#endif
+
+/* The number of threads to use by default: the CPUs online, limited by our
+ * affinity mask and by any cgroup CPU quota so that inside a container we
+ * don't start far more threads than we will be given time to run. What
+ * limited it is kept to be shown with -v. */
+int get_cpus(rzip_control *control)
+{
+	int cpus = PROCESSORS;
+#ifdef __linux
+	cpu_set_t set;
+	double quota;
+
+	control->cpus_online = cpus;
+	control->threads_limit = NULL;
+	if (!sched_getaffinity(0, sizeof(set), &set) && CPU_COUNT(&set) < cpus) {
+		cpus = CPU_COUNT(&set);
+		control->threads_limit = "CPU affinity";
+	}
+	quota = cgroup_cpu_quota();
+	if (quota > 0 && ceil(quota) < cpus) {
+		cpus = ceil(quota);
+		control->threads_limit = "cgroup CPU quota";
+	}
+#endif
+	return MAX(cpus, 1);
+}
+
 i64 nloops(i64 seconds, uchar *b1, uchar *b2)
 {
 	i64 nloops;
@@ -194,7 +336,14 @@ bool write_magic(rzip_control *control)
 	if (!NO_MD5)
 		magic[21] = 1;
 	if (ENCRYPT)
-		magic[22] = 1;
+		magic[22] |= MAGIC_ENCRYPTED;
+	/* Versions without hole records refuse anything but 0 or 1 here so
+	 * they stop cleanly instead of failing part way through */
+	if (control->holes)
+		magic[22] |= MAGIC_HOLES;
+	/* The minimum match the rzip stage used. Decompression does not need
+	 * it but it is kept for -i and older versions ignore it */
+	magic[23] = control->min_match;
 
 	if (unlikely(fdout_seekto(control, 0)))
 		fatal_return(("Failed to seek to BOF to write Magic Header\n"), false);
@@ -258,12 +407,12 @@ static bool get_magic(rzip_control *control, char *magic)
 		else
 			print_verbose("Unknown hash, falling back to CRC\n");
 	}
-	encrypted = magic[22];
+	if (unlikely(magic[22] & ~(MAGIC_ENCRYPTED | MAGIC_HOLES)))
+		failure_return(("Unknown encryption\n"), false);
+	control->holes = !!(magic[22] & MAGIC_HOLES);
+	encrypted = magic[22] & MAGIC_ENCRYPTED;
 	if (encrypted) {
-		if (encrypted == 1)
-			control->flags |= FLAG_ENCRYPT;
-		else
-			failure_return(("Unknown encryption\n"), false);
+		control->flags |= FLAG_ENCRYPT;
 		/* In encrypted files, the size field is used to store the salt
 		 * instead and the size is unknown, just like a STDOUT chunked
 		 * file */
@@ -275,6 +424,8 @@ static bool get_magic(rzip_control *control, char *magic)
 		print_output("Asked to decrypt a non-encrypted archive. Bypassing decryption.\n");
 		control->flags &= ~FLAG_ENCRYPT;
 	}
+	/* Archives from before --min-match always used the default */
+	control->min_match = magic[23] ? (uchar)magic[23] : MINIMUM_MATCH;
 	return true;
 }
 
@@ -309,6 +460,37 @@ static bool preserve_perms(rzip_control *control, int fd_in, int fd_out)
 	return true;
 }
 
+/* Reserve len bytes for the output file up front without changing its size,
+ * so it is laid out in few extents instead of growing with every write. This
+ * is only a hint, so nothing is reserved where it isn't supported. */
+static void preallocate_fdout(rzip_control *control, int fd_out, i64 len)
+{
+	control->preallocated = false;
+#ifdef FALLOC_FL_KEEP_SIZE
+	if (NO_PREALLOC || len <= 0)
+		return;
+	if (fallocate(fd_out, FALLOC_FL_KEEP_SIZE, 0, len))
+		print_maxverbose("Unable to preallocate %lld bytes for %s\n", len, control->outfile);
+	else {
+		print_maxverbose("Preallocated %lld bytes for %s\n", len, control->outfile);
+		control->preallocated = true;
+	}
+#endif
+}
+
+/* Give back whatever was reserved past where the output ended up */
+static bool trim_fdout(rzip_control *control, int fd_out)
+{
+	struct stat st;
+
+	if (!control->preallocated)
+		return true;
+	control->preallocated = false;
+	if (unlikely(fstat(fd_out, &st) || ftruncate(fd_out, st.st_size)))
+		fatal_return(("Failed to trim preallocated space from %s\n", control->outfile), false);
+	return true;
+}
+
 static bool preserve_times(rzip_control *control, int fd_in)
 {
 	struct utimbuf times;
@@ -371,6 +553,8 @@ static bool fwrite_stdout(rzip_control *control, void *buf, i64 len)
 		total += ret;
 	}
 	fflush(control->outFILE);
+	if (control->stats)
+		control->stats->out_bytes += total;
 	return true;
 }
 
@@ -452,6 +636,8 @@ static bool dump_tmpoutfile(rzip_control *control)
 				dealloc(buf);
 				fatal_return(("Failed write in dump_tmpoutfile\n"), false);
 			}
+			if (control->stats)
+				control->stats->out_bytes += num_written;
 		}
 
 		dealloc(buf);
@@ -553,7 +739,7 @@ static bool read_tmpinmagic(rzip_control *control)
 
 	memset(magic, 0, sizeof(magic));
 	for (i = 0; i < 24; i++) {
-		tmpchar = getchar();
+		tmpchar = getc(control->inFILE);
 		if (unlikely(tmpchar == EOF))
 			failure_return(("Reached end of file on STDIN prematurely on v05 magic read\n"), false);
 		magic[i] = (char)tmpchar;
@@ -582,9 +768,9 @@ bool read_tmpinfile(rzip_control *control, int fd_in)
 
 	while (1) {
 		ssize_t num_read, num_written;
-		num_read = fread(buf, 1, STDIO_TMPFILE_BUFFER_SIZE, stdin);
+		num_read = fread(buf, 1, STDIO_TMPFILE_BUFFER_SIZE, control->inFILE);
 		if (unlikely(num_read == 0)) {
-			if (ferror(stdin)) {
+			if (ferror(control->inFILE)) {
 				dealloc(buf);
 				fatal_return(("Failed read in read_tmpinfile\n"), false);
 			} else {
@@ -930,6 +1116,8 @@ bool decompress_file(rzip_control *control)
 			else
 				failure_return(("Inadequate free space to decompress file, use -f to override.\n"), false);
 		}
+		/* The exact size is known unless it was encrypted or streamed */
+		preallocate_fdout(control, fd_out, expected_size);
 	}
 	control->fd_out = fd_out;
 	control->fd_hist = fd_hist;
@@ -948,14 +1136,20 @@ bool decompress_file(rzip_control *control)
 
 	print_output("Decompressing...\n");
 
-	if (unlikely(runzip_fd(control, fd_in, fd_hist, expected_size) < 0)) {
+	if (unlikely(!stats_init(control) || !trace_init(control) || !metrics_start(control) ||
+		     !nodes_init(control) || !throttle_init(control)))
+		goto error;
+	if (unlikely(runzip_fd(control, fd_in, fd_hist, expected_size) < 0 ||
+		     !trim_fdout(control, fd_out))) {
 		clear_rulist(control);
-		return false;
+		goto error;
 	}
 
 	/* We can now safely delete sinfo and pthread data of all threads
 	 * created. */
 	clear_rulist(control);
+	nodes_free(control);
+	throttle_free(control);
 
 	/* if we get here, no fatal_return(( errors during decompression */
 	print_progress("\r");
@@ -970,6 +1164,8 @@ bool decompress_file(rzip_control *control)
 
 	if (TMP_OUTBUF)
 		close_tmpoutbuf(control);
+	if (TMP_INBUF)
+		close_tmpinbuf(control);
 
 	if (fd_out > 0) {
 		if (unlikely(close(fd_hist) || close(fd_out)))
@@ -991,8 +1187,25 @@ bool decompress_file(rzip_control *control)
 	if (ENCRYPT)
 		release_hashes(control);
 
+	stats_write(control);
+	trace_write(control);
+	metrics_stop(control);
 	dealloc(control->outfile);
 	return true;
+error:
+	/* Whatever of the chain above was set up, undone in reverse */
+	throttle_free(control);
+	nodes_free(control);
+	metrics_stop(control);
+	trace_free(control);
+	stats_free(control);
+	if (fd_hist != -1)
+		close(fd_hist);
+	if (fd_out != -1)
+		close(fd_out);
+	if (!IS_FROM_FILE)
+		close(fd_in);
+	return false;
 }
 
 bool get_header_info(rzip_control *control, int fd_in, uchar *ctype, i64 *c_len,
@@ -1082,7 +1295,7 @@ bool get_fileinfo(rzip_control *control)
 	if ( IS_FROM_FILE )
 		fd_in = fileno(control->inFILE);
 	else if (STDIN)
-		fd_in = 0;
+		fd_in = fileno(control->inFILE);
 	else {
 		fd_in = open(infilecopy, O_RDONLY);
 		if (unlikely(fd_in == -1))
@@ -1280,6 +1493,10 @@ done:
 		print_output("rzip + zpaq\n");
 	else
 		print_output("Dunno wtf\n");
+	if (control->min_match != MINIMUM_MATCH)
+		print_output("  Minimum match length: %d\n", control->min_match);
+	if (control->holes)
+		print_output("  Sparse: holes stored as records\n");
 
 	print_output("\n");
 
@@ -1318,6 +1535,163 @@ error:
 	return false;
 }
 
+/* Predict the compressed size and time of a file with each backend without
+ * writing anything. A sparse rzip pass over the whole file estimates the long
+ * range matches for the window that would be used, and for an unlimited
+ * window when that is smaller than the file. Trial compression of samples of
+ * the unmatched data estimates how well each backend compresses what is left. */
+bool estimate_file(rzip_control *control)
+{
+	static const struct {
+		const char *name;
+		uchar c_type;
+	} backends[] = {
+		{ "lzma", CTYPE_LZMA },
+		{ "lzo", CTYPE_LZO },
+		{ "bzip2", CTYPE_BZIP2 },
+		{ "gzip", CTYPE_GZIP },
+		{ "zpaq", CTYPE_ZPAQ },
+		{ "none", CTYPE_NONE },
+	};
+	i64 len, sample_len, nsamples, windows[2], matched[2], matches[2], i;
+	i64 pages, free_pages, want, skip, o;
+	int nwindows = 1, sample_bits, b, w, fd_in;
+	uchar *buf, *samples, *map = NULL;
+	bool progress = SHOW_PROGRESS;
+	double rzip_spb;
+	struct stat st;
+
+	if (unlikely(STDIN))
+		fatal_return(("Cannot estimate from STDIN\n"), false);
+	fd_in = open(control->infile, O_RDONLY);
+	if (unlikely(fd_in == -1))
+		fatal_return(("Failed to open %s\n", control->infile), false);
+	if (unlikely(fstat(fd_in, &st))) {
+		close(fd_in);
+		fatal_return(("Failed to fstat %s\n", control->infile), false);
+	}
+	len = st.st_size;
+	if (!len) {
+		close(fd_in);
+		print_output("%s: nothing to estimate for an empty file\n", control->infile);
+		return true;
+	}
+	buf = (uchar *)mmap(NULL, len, PROT_READ, MAP_SHARED, fd_in, 0);
+	if (unlikely(buf == MAP_FAILED)) {
+		close(fd_in);
+		fatal_return(("Failed to mmap %s\n", control->infile), false);
+	}
+	if (unlikely(!init_mutex(control, &control->control_lock)))
+		goto error;
+
+	/* The chunk size rzip_fd would choose */
+	if (UNLIMITED)
+		windows[0] = len;
+	else if (control->window)
+		windows[0] = control->window * 100 * 1024 * 1024;
+	else
+		windows[0] = control->ramsize / 3 * 2;
+	if (windows[0] < len)
+		windows[nwindows++] = len;
+	map = calloc(len / ESTIMATE_PAGE / 8 + 1, 1);
+	if (unlikely(!map))
+		fatal_goto(("Failed to calloc match map in estimate_file\n"), error);
+	sample_bits = rzip_estimate_matches(control, buf, len, nwindows, windows, matched, matches, map);
+	if (unlikely(sample_bits < 0))
+		goto error;
+
+	/* Sample runs of the pages rzip would leave as literals, spread evenly
+	 * over them, since they are all the backend will see. */
+	pages = (len + ESTIMATE_PAGE - 1) / ESTIMATE_PAGE;
+	for (i = 0, free_pages = 0; i < pages; i++)
+		free_pages += !(map[i / 8] & (1 << (i % 8)));
+	if (!free_pages) {
+		memset(map, 0, pages / 8 + 1);
+		free_pages = pages;
+	}
+	want = MIN(free_pages, ESTIMATE_SAMPLES * ESTIMATE_SAMPLE_LEN / ESTIMATE_PAGE);
+	skip = MAX(1, free_pages / ESTIMATE_RUN / MAX(want / ESTIMATE_RUN, 1));
+	samples = malloc(want * ESTIMATE_PAGE);
+	if (unlikely(!samples))
+		fatal_goto(("Failed to malloc samples in estimate_file\n"), error);
+	for (i = 0, o = 0, sample_len = 0; i < pages && sample_len < want * ESTIMATE_PAGE; i++) {
+		if (map[i / 8] & (1 << (i % 8)))
+			continue;
+		if (!(o++ / ESTIMATE_RUN % skip)) {
+			i64 page_len = MIN(ESTIMATE_PAGE, len - i * ESTIMATE_PAGE);
+
+			memcpy(samples + sample_len, buf + i * ESTIMATE_PAGE, page_len);
+			sample_len += page_len;
+		}
+	}
+	dealloc(map);
+	munmap(buf, len);
+	close(fd_in);
+	nsamples = MAX(1, sample_len / ESTIMATE_SAMPLE_LEN);
+	sample_len = MIN(sample_len, ESTIMATE_SAMPLE_LEN);
+	rzip_spb = rzip_sample_speed(control, samples, nsamples * sample_len);
+
+	print_output("%s: %lld bytes, sampled %lld x %lld bytes, matches sampled every %d bytes\n",
+		     control->infile, len, nsamples, sample_len, 1 << sample_bits);
+	for (w = 0; w < nwindows; w++)
+		print_output("Window %lldMB: %.1f%% of input found in %lld long range matches\n",
+			     windows[w] / 1024 / 1024, 100.0 * matched[w] / len, matches[w]);
+	print_output("\nBackend  Level  Window MB   Estimated size    Ratio  Estimated time\n");
+	/* The backends would print their progress into the table */
+	control->flags &= ~FLAG_SHOW_PROGRESS;
+	for (b = 0; b < (int)(sizeof(backends) / sizeof(backends[0])); b++) {
+		double c_frac = 1, spb = 0, start;
+		i64 c_total = 0;
+
+		for (i = 0; i < nsamples && backends[b].c_type != CTYPE_NONE; i++) {
+			uchar *trial = malloc(sample_len);
+			i64 c_len;
+
+			if (unlikely(!trial))
+				fatal_goto(("Failed to malloc trial buffer in estimate_file\n"), error_free);
+			memcpy(trial, samples + i * sample_len, sample_len);
+			start = stats_time();
+			c_len = trial_compress_buf(control, backends[b].c_type, &trial, sample_len);
+			spb += stats_time() - start;
+			dealloc(trial);
+			c_total += c_len < 0 ? sample_len : c_len;
+		}
+		if (c_total) {
+			c_frac = (double)c_total / (nsamples * sample_len);
+			spb /= nsamples * sample_len;
+		}
+		for (w = 0; w < nwindows; w++) {
+			int chunk_bytes = 1;
+			i64 literals = len - matched[w], size;
+			double secs;
+
+			while (MIN(windows[w], len) >> (chunk_bytes * 8))
+				chunk_bytes++;
+			/* Each match costs a header, length and offset */
+			size = literals * c_frac + matches[w] * (3 + chunk_bytes);
+			secs = len * rzip_spb + literals * spb / MAX(control->threads, 1);
+			print_output("%-8s %5d  %9lld  %15lld  %7.3f  %02d:%02d:%02d\n",
+				     backends[b].name, control->compression_level,
+				     windows[w] / 1024 / 1024, size, (double)len / MAX(size, 1),
+				     (int)secs / 3600, (int)secs / 60 % 60, (int)secs % 60);
+		}
+	}
+	if (progress)
+		control->flags |= FLAG_SHOW_PROGRESS;
+	dealloc(samples);
+	return true;
+error_free:
+	if (progress)
+		control->flags |= FLAG_SHOW_PROGRESS;
+	dealloc(samples);
+	return false;
+error:
+	dealloc(map);
+	munmap(buf, len);
+	close(fd_in);
+	return false;
+}
+
 /*
   compress one file from the command line
 */
@@ -1333,6 +1707,11 @@ bool compress_file(rzip_control *control)
 	if (ENCRYPT)
 		if (unlikely(!get_hash(control, 1)))
 			return false;
+	if (unlikely(!stats_init(control) || !trace_init(control) || !metrics_start(control) ||
+		     !nodes_init(control) || !throttle_init(control)))
+		goto error;
+	if (AUTOTUNE && unlikely(!autotune(control)))
+		goto error;
 	memset(header, 0, sizeof(header));
 
 	if ( IS_FROM_FILE )
@@ -1341,15 +1720,15 @@ bool compress_file(rzip_control *control)
 		 /* is extension at end of infile? */
 		if ((tmp = strrchr(control->infile, '.')) && !strcmp(tmp, control->suffix)) {
 			print_err("%s: already has %s suffix. Skipping...\n", control->infile, control->suffix);
-			return false;
+			goto error;
 		}
 
         fd_in = open(control->infile, O_RDONLY);
 		if (unlikely(fd_in == -1))
-			fatal_return(("Failed to open %s\n", control->infile), false);
+			fatal_goto(("Failed to open %s\n", control->infile), error);
 	} 
 	else
-		fd_in = 0;
+		fd_in = fileno(control->inFILE);
 
 	if (!STDOUT) {
 		if (control->outname) {
@@ -1420,11 +1799,25 @@ bool compress_file(rzip_control *control)
 	if (unlikely(!STDOUT && write(fd_out, header, sizeof(header)) != sizeof(header)))
 		fatal_goto(("Cannot write file header\n"), error);
 
+	if (!STDOUT && !STDIN) {
+		struct stat st;
+
+		/* Guess at the compressed size from the data actually stored,
+		 * as holes in sparse files cost nothing, and trim it after */
+		if (fstat(fd_in, &st) == 0) {
+			i64 len = MIN((i64)st.st_size, (i64)st.st_blocks * 512);
+
+			preallocate_fdout(control, fd_out, NO_COMPRESS ? len : len / PREALLOC_RATIO);
+		}
+	}
+
 	rzip_fd(control, fd_in, fd_out);
+	nodes_free(control);
+	throttle_free(control);
 
 	/* Write magic at end b/c lzma does not tell us properties until it is done */
 	if (!STDOUT) {
-		if (unlikely(!write_magic(control)))
+		if (unlikely(!write_magic(control) || !trim_fdout(control, fd_out)))
 			goto error;
 	}
 
@@ -1436,12 +1829,14 @@ bool compress_file(rzip_control *control)
 		goto error;
 	}
 
-	if (unlikely(close(fd_in))) {
+	/* Leave stdin to whoever opened it */
+	if (unlikely(!STDIN && close(fd_in))) {
 		fatal("Failed to close fd_in\n");
 		fd_in = -1;
 		goto error;
 	}
-	if (unlikely(!STDOUT && close(fd_out)))
+	/* With stdout this is the temporary file backing the output buffer */
+	if (unlikely(fd_out != -1 && close(fd_out)))
 		fatal_return(("Failed to close fd_out\n"), false);
 	if (TMP_OUTBUF)
 		close_tmpoutbuf(control);
@@ -1451,12 +1846,21 @@ bool compress_file(rzip_control *control)
 			fatal_return(("Failed to unlink %s\n", control->infile), false);
 	}
 
+	stats_write(control);
+	trace_write(control);
+	metrics_stop(control);
 	dealloc(control->outfile);
 	return true;
 error:
-	if (! IS_FROM_FILE && STDIN && (fd_in > 0))
+	/* Whatever of the chain above was set up, undone in reverse */
+	throttle_free(control);
+	nodes_free(control);
+	metrics_stop(control);
+	trace_free(control);
+	stats_free(control);
+	if (!IS_FROM_FILE && !STDIN && (fd_in > 0))
 		close(fd_in);
-	if ((!STDOUT) && (fd_out > 0))
+	if (fd_out > 0)
 		close(fd_out);
 	return false;
 }
@@ -1474,13 +1878,15 @@ bool initialise_control(rzip_control *control)
 	control->flags = FLAG_SHOW_PROGRESS | FLAG_KEEP_FILES | FLAG_THRESHOLD;
 	control->suffix = ".lrz";
 	control->compression_level = 7;
+	control->min_match = MINIMUM_MATCH;
 	control->ramsize = get_ram(control);
 	if (unlikely(control->ramsize == -1))
 		return false;
-	/* for testing single CPU */
-	control->threads = PROCESSORS;	/* get CPUs for LZMA */
+	control->threads = get_cpus(control);	/* get CPUs for LZMA */
 	control->page_size = PAGE_SIZE;
 	control->nice_val = 19;
+	control->metrics_interval = 5;
+	control->jobs = 1;
 
 	/* The first 5 bytes of the salt is the time in seconds.
 	 * The next 2 bytes encode how many times to hash the password.
@@ -22,6 +22,7 @@
 #include "lrzip_private.h"
 
 i64 get_ram(rzip_control *control);
+int get_cpus(rzip_control *control);
 i64 nloops(i64 seconds, uchar *b1, uchar *b2);
 bool write_magic(rzip_control *control);
 bool read_magic(rzip_control *control, int fd_in, i64 *expected_size);
@@ -33,6 +34,7 @@ bool read_tmpinfile(rzip_control *control, int fd_in);
 bool decompress_file(rzip_control *control);
 bool get_header_info(rzip_control *control, int fd_in, uchar *ctype, i64 *c_len, i64 *u_len, i64 *last_head);
 bool get_fileinfo(rzip_control *control);
+bool estimate_file(rzip_control *control);
 bool compress_file(rzip_control *control);
 bool write_fdout(rzip_control *control, void *buf, i64 len);
 bool write_fdin(rzip_control *control);
@@ -24,6 +24,8 @@
 
 #define NUM_STREAMS 2
 #define STREAM_BUFSIZE (1024 * 1024 * 10)
+#define ESTIMATE_PAGE 4096 /* Granularity of the --estimate match map */
+#define SMALL_INPUT (1024 * 1024) /* Files below this are compressed inline */
 
 #include <stdlib.h>
 #include <stdint.h>
@@ -230,6 +232,9 @@ typedef sem_t cksem_t;
 #define FLAG_TMP_INBUF		(1 << 22)
 #define FLAG_ENCRYPT		(1 << 23)
 #define FLAG_OUTPUT		(1 << 24)
+#define FLAG_ESTIMATE		(1 << 25)
+#define FLAG_AUTOTUNE		(1 << 26)
+#define FLAG_NO_PREALLOC	(1 << 27)
 
 #define NO_MD5		(!(HASH_CHECK) && !(HAS_MD5))
 
@@ -263,6 +268,12 @@ typedef sem_t cksem_t;
 # endif
 #endif
 
+/* Default shortest match rzip looks for, and the width of its rolling tag.
+ * --min-match can change it per archive within these limits */
+#define MINIMUM_MATCH 31
+#define MIN_MATCH_LOW 16
+#define MIN_MATCH_HIGH 64
+
 #define dealloc(ptr) do { \
 	free(ptr); \
 	ptr = NULL; \
@@ -300,6 +311,9 @@ typedef sem_t cksem_t;
 #define STDIN		(control->flags & FLAG_STDIN)
 #define STDOUT		(control->flags & FLAG_STDOUT)
 #define INFO		(control->flags & FLAG_INFO)
+#define ESTIMATE	(control->flags & FLAG_ESTIMATE)
+#define AUTOTUNE	(control->flags & FLAG_AUTOTUNE)
+#define NO_PREALLOC	(control->flags & FLAG_NO_PREALLOC)
 #define UNLIMITED	(control->flags & FLAG_UNLIMITED)
 #define HASH_CHECK	(control->flags & FLAG_HASH)
 #define HAS_MD5		(control->flags & FLAG_MD5)
@@ -347,6 +361,98 @@ struct checksum {
 	i64 len;
 };
 
+/* Performance counters for --stats-json, one per backend block */
+struct block_stats {
+	int chunk;		/* Index of the chunk this block belongs to */
+	int streamno;
+	uchar c_type;
+	i64 u_len;
+	i64 c_len;
+	double backend_wall;	/* Time spent in the backend (de)compressor */
+	double backend_cpu;
+	double output_wait;	/* Time spent waiting on output_cond for our turn */
+};
+
+/* ...and one per rzip chunk */
+struct chunk_stats {
+	i64 u_len;
+	i64 c_len;		/* Sum of the compressed blocks of this chunk */
+	double rzip_wall;	/* Time spent in hash_search or runzip_chunk */
+	double rzip_cpu;
+	i64 matches;
+	i64 match_bytes;
+	i64 literals;
+	i64 literal_bytes;
+};
+
+struct perf_stats {
+	pthread_mutex_t lock;	/* Protects everything below */
+	double start_wall;
+	double start_cpu;
+	i64 in_bytes;
+	i64 out_bytes;
+	double rzip_wall;
+	double rzip_cpu;
+	double backend_wall;
+	double backend_cpu;
+	double backend_wait;	/* Time the rzip stage spent waiting for backend threads */
+	double output_wait;
+	double io_wall;		/* Time in explicit read and write calls */
+	double hash_wall;	/* Time spent on crc/md5 integrity hashing */
+	double hash_cpu;
+	i64 tag_hits;
+	i64 tag_misses;
+	i64 filter_skips;	/* Lookups the tag filter saved from the hash table */
+	i64 filter_false;	/* Lookups it passed that found no such tag */
+	i64 inserts;
+	int chunks;
+	int chunks_alloced;
+	struct chunk_stats *chunk;
+	int blocks;
+	int blocks_alloced;
+	struct block_stats *block;
+};
+
+/* Timeline spans for --trace, each on a lane shown as a thread */
+struct trace_event {
+	const char *name;
+	int lane;
+	double start;
+	double end;
+	i64 bytes;
+};
+
+#define TRACE_RZIP	0
+#define TRACE_CKSUM	1
+#define TRACE_BACKEND	2	/* Plus the backend thread number */
+
+struct trace_log {
+	pthread_mutex_t lock;
+	int events;
+	int events_alloced;
+	struct trace_event *event;
+	int lanes;	/* Highest lane used plus one */
+};
+
+/* Live snapshot state for --metrics, written out by its own thread */
+struct live_metrics {
+	pthread_mutex_t lock;	/* Protects everything below */
+	pthread_cond_t cond;
+	pthread_t pthread;
+	bool stop;
+	double start;
+	i64 expected;		/* Total bytes to process, 0 if unknown */
+	i64 done;		/* Bytes through rzip or runzip so far */
+	i64 bytes_in;		/* Compressed bytes read when decompressing */
+	i64 bytes_out;		/* Compressed bytes written when compressing */
+	int active_threads;
+	int chunk;
+	int passes;
+	double last_time;	/* For the current rate */
+	i64 last_done;
+	double rate;
+};
+
 typedef i64 tag;
 
 struct node {
@@ -360,6 +466,12 @@ struct runzip_node {
 	struct runzip_node *prev;
 };
 
+/* A range of a chunk the filesystem has no blocks allocated for */
+struct hole {
+	i64 start;
+	i64 end;
+};
+
 struct rzip_state {
 	void *ss;
 	struct node *sslist;
@@ -372,6 +484,11 @@ struct rzip_state {
 	i64 hash_limit;
 	tag minimum_tag_mask;
 	i64 tag_clean_ptr;
+	i64 bitness_count[65]; // Hash entries by number of low tag bits set
+	i64 hash_gen; // Generation of the entries in use in the hash table
+	uint64_t *filter; // Bloom filter of the tags in the hash table
+	int filter_bits; // log2 of the words in filter
+	i64 filter_adds; // Tags added since the filter was last rebuilt
 	i64 last_match;
 	i64 chunk_size;
 	i64 mmap_size;
@@ -379,6 +496,9 @@ struct rzip_state {
 	uint32_t cksum;
 	int fd_in, fd_out;
 	char stdin_eof;
+	i64 victim_round;
+	struct hole *holes;
+	int nholes;
 	struct {
 		i64 inserts;
 		i64 literals;
@@ -387,6 +507,10 @@ struct rzip_state {
 		i64 match_bytes;
 		i64 tag_hits;
 		i64 tag_misses;
+		i64 filter_skips;
+		i64 filter_false;
+		i64 holes;
+		i64 hole_bytes;
 	} stats;
 };
 
@@ -412,6 +536,7 @@ struct rzip_control {
 	FILE *msgerr; //stream for output errors
 	char *suffix;
 	uchar compression_level;
+	int min_match; // Shortest match and tag window of the rzip stage
 	i64 overhead; // compressor overhead
 	i64 usable_ram; // the most ram we'll try to use on one activity
 	i64 maxram; // the largest chunk of ram to allocate
@@ -422,6 +547,11 @@ struct rzip_control {
 	i64 max_chunk;
 	i64 max_mmap;
 	int threads;
+	int cpu_budget; // CPUs shared out between all the threads of a job
+	int lzma_threads; // Match finder mode of each lzma backend, 1 or 2
+	i64 tune_bufsize; // Largest backend block chosen by --autotune, 0 if unset
+	int cpus_online;
+	const char *threads_limit; // What capped the default threads below cpus_online
 	char nice_val;		// added for consistency
 	int current_priority;
 	char major_version;
@@ -467,12 +597,37 @@ struct rzip_control {
 	char chunk_bytes;
 	struct sliding_buffer sb;
 	void (*do_mcpy)(rzip_control *, unsigned char *, i64, i64);
-	void (*next_tag)(rzip_control *, struct rzip_state *, i64, tag *);
-	tag (*full_tag)(rzip_control *, struct rzip_state *, i64);
-	i64 (*match_len)(rzip_control *, struct rzip_state *, i64, i64, i64, i64 *);
 
 	pthread_t *pthreads;
 	struct runzip_node *ruhead;
+
+	/* Stream thread state, kept per job so that several jobs can run
+	 * concurrently within the one process */
+	struct compress_thread *cthreads;
+	int next_cthread; // Next compthread for clear_buffer to hand off to
+	long output_thread; // Thread whose turn it is to write or hand over output
+	pthread_mutex_t output_lock;
+	pthread_cond_t output_cond;
+
+	char *stats_json; // File to write the --stats-json report to
+	struct perf_stats *stats; // Only allocated when stats_json is set
+	char *trace_file; // File to write the --trace timeline to
+	struct trace_log *trace; // Only allocated when trace_file is set
+	char *metrics_file; // File or unix:socket to export live metrics to
+	int metrics_interval; // Seconds between metrics snapshots
+	struct live_metrics *metrics; // Only allocated when metrics_file is set
+	char *numa_nodes; // --numa-nodes list of nodes to keep threads on
+	double read_limit; // Bytes per second, 0 for unlimited
+	double write_limit;
+	int ioprio; // Encoded io priority class and level, 0 to leave alone
+	int cpu_limit; // Percentage of the time each thread may run
+	struct throttle *throttle; // Only allocated when a bandwidth limit is set
+	struct numa_nodes *numa; // Only allocated when placement is worthwhile
+	int jobs; // Files processed at once, 0 for one per CPU
+	bool small_input; // Whole input is under SMALL_INPUT so skip the threads
+	bool sparse_out; // Holes have been seeked over when decompressing
+	bool preallocated; // Space was reserved past the end of fd_out
+	bool holes; // Archive may hold hole records
 };
 
 struct uncomp_thread {
@@ -512,6 +667,7 @@ struct stream_info {
 	long next_thread;
 	int chunks;
 	char chunk_bytes;
+	int chunk_no; // Index into perf_stats chunk records
 };
 
 static inline void print_stuff(const rzip_control *control, int level, unsigned int line, const char *file, const char *func, const char *format, ...)
@@ -0,0 +1,467 @@
+/*
+   Copyright (C) 2022 Con Kolivas
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* lrzipd - lrzip as a service. Listens on a unix socket and runs the jobs it
+ * is sent on a fixed pool of job threads, so process startup, ram detection,
+ * reading lrzip.conf and generating the crc table are only paid for once,
+ * and the threads and ram of the machine are shared out between the jobs.
+ * Each job thread forks to do the work, as much of the library gives up on
+ * errors by exiting, and a failed job must take down neither the daemon nor
+ * the jobs of other clients.
+ *
+ * Each connection carries one request of newline terminated lines ended by
+ * an empty line:
+ *
+ *	compress | decompress | test
+ *	in <path>		else the first file descriptor passed
+ *	out <path>		else the second file descriptor passed
+ *	level <1-9>
+ *	backend lzma | lzo | bzip2 | gzip | zpaq | none
+ *	force
+ *
+ * File descriptors are passed with SCM_RIGHTS alongside the request and may
+ * be pipes or sockets. The reply is one line, either OK or ERROR followed by
+ * the reason, after which the connection is closed. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <signal.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+
+#include "lrzip_core.h"
+#include "stats.h"
+#include "stream.h"
+#include "util.h"
+/* needed for CRC routines */
+#include "lzma/C/7zCrc.h"
+
+#define REQUEST_LEN	65536
+#define ERR_LEN		256
+#define MAX_FDS		2
+
+struct job {
+	pthread_t pthread;
+	rzip_control control;
+	char request[REQUEST_LEN];
+	char *err;		/* Shared with the child running the job */
+	int fd[MAX_FDS];
+	int fds;
+};
+
+static rzip_control base_control;
+static const char *sockname;
+static int listen_fd, jobs = 1;
+static bool verbose;
+
+static void usage(void)
+{
+	fprintf(stderr, "lrzipd version %s\n", PACKAGE_VERSION);
+	fprintf(stderr, "Usage: lrzipd [options] socket\n");
+	fprintf(stderr, "	-j, --jobs n		run up to n jobs at once (default 1)\n");
+	fprintf(stderr, "	-p, --threads n		threads shared between all jobs (default CPUs)\n");
+	fprintf(stderr, "	-m, --maxram size	ram shared between all jobs in hundreds of MB\n");
+	fprintf(stderr, "	-v, --verbose		log every job to stderr\n");
+}
+
+static void sighandler(int sig __UNUSED__)
+{
+	unlink(sockname);
+	_exit(0);
+}
+
+/* Keep the last error the library reports to send back to the client */
+static void job_log(void *data, unsigned int level, unsigned int line __UNUSED__,
+		    const char *file __UNUSED__, const char *func __UNUSED__,
+		    const char *format, va_list args)
+{
+	struct job *job = data;
+	char *nl;
+
+	if (level)
+		return;
+	vsnprintf(job->err, ERR_LEN, format, args);
+	while ((nl = strchr(job->err, '\n')))
+		*nl = ' ';
+}
+
+/* Read until the empty line ending the request, collecting any descriptors
+ * passed along with it */
+static bool read_request(struct job *job, int fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+	int len = 0, i, n;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t ret;
+
+	job->fds = 0;
+	while (len < REQUEST_LEN - 1) {
+		iov.iov_base = job->request + len;
+		iov.iov_len = REQUEST_LEN - 1 - len;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+		if (ret <= 0)
+			return false;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (i = 0; i < n; i++) {
+				int passed;
+
+				memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				if (job->fds < MAX_FDS)
+					job->fd[job->fds++] = passed;
+				else
+					close(passed);
+			}
+		}
+		len += ret;
+		job->request[len] = '\0';
+		if (!strcmp(job->request, "\n") || strstr(job->request, "\n\n"))
+			return true;
+	}
+	return false;
+}
+
+static bool set_backend(rzip_control *control, const char *name)
+{
+	control->flags &= ~FLAG_NOT_LZMA;
+	if (!strcmp(name, "lzo"))
+		control->flags |= FLAG_LZO_COMPRESS;
+	else if (!strcmp(name, "bzip2"))
+		control->flags |= FLAG_BZIP2_COMPRESS;
+	else if (!strcmp(name, "gzip"))
+		control->flags |= FLAG_ZLIB_COMPRESS;
+	else if (!strcmp(name, "zpaq"))
+		control->flags |= FLAG_ZPAQ_COMPRESS;
+	else if (!strcmp(name, "none"))
+		control->flags |= FLAG_NO_COMPRESS;
+	else if (strcmp(name, "lzma"))
+		return false;
+	return true;
+}
+
+/* Turn the request into a job control, each job getting an equal share of
+ * the threads and ram */
+static bool parse_request(struct job *job)
+{
+	rzip_control *control = &job->control;
+	char *line, *next, *arg;
+	const char *in = NULL, *out = NULL;
+	bool have_cmd = false;
+	int fd = 0;
+
+	memcpy(control, &base_control, sizeof(rzip_control));
+	control->library_mode = 1;
+	control->log_cb = job_log;
+	control->log_data = job;
+	control->log_level = 0;
+	control->msgout = NULL;
+	control->flags &= ~FLAG_SHOW_PROGRESS;
+	control->flags |= FLAG_KEEP_FILES;
+	control->threads = MAX(base_control.threads / jobs, 1);
+	control->ramsize = base_control.ramsize / jobs;
+
+	for (line = job->request; *line && *line != '\n'; line = next) {
+		next = strchr(line, '\n');
+		*next++ = '\0';
+		arg = strchr(line, ' ');
+		if (arg)
+			*arg++ = '\0';
+		if (!have_cmd) {
+			if (!strcmp(line, "decompress"))
+				control->flags |= FLAG_DECOMPRESS;
+			else if (!strcmp(line, "test"))
+				control->flags |= FLAG_TEST_ONLY;
+			else if (strcmp(line, "compress"))
+				goto bad;
+			have_cmd = true;
+		} else if (!strcmp(line, "in") && arg)
+			in = arg;
+		else if (!strcmp(line, "out") && arg)
+			out = arg;
+		else if (!strcmp(line, "level") && arg) {
+			control->compression_level = atoi(arg);
+			if (control->compression_level < 1 || control->compression_level > 9)
+				goto bad;
+		} else if (!strcmp(line, "backend") && arg) {
+			if (!set_backend(control, arg))
+				goto bad;
+		} else if (!strcmp(line, "force"))
+			control->flags |= FLAG_FORCE_REPLACE;
+		else
+			goto bad;
+	}
+	if (!have_cmd)
+		goto bad;
+
+	if (in)
+		control->infile = (char *)in;
+	else if (fd < job->fds) {
+		control->inFILE = fdopen(job->fd[fd], "r");
+		if (!control->inFILE)
+			goto bad_fd;
+		job->fd[fd++] = -1;
+		control->flags |= FLAG_STDIN;
+	} else {
+		snprintf(job->err, ERR_LEN, "No input path or descriptor");
+		return false;
+	}
+	if (out) {
+		control->outname = (char *)out;
+		control->suffix = "";
+	} else if (fd < job->fds) {
+		control->outFILE = fdopen(job->fd[fd], "w");
+		if (!control->outFILE)
+			goto bad_fd;
+		job->fd[fd] = -1;
+		control->flags |= FLAG_STDOUT;
+	} else if (!TEST_ONLY) {
+		snprintf(job->err, ERR_LEN, "No output path or descriptor");
+		return false;
+	}
+	setup_overhead(control);
+	setup_ram(control);
+	return true;
+bad:
+	snprintf(job->err, ERR_LEN, "Invalid request line: %.*s", ERR_LEN / 2, line);
+	return false;
+bad_fd:
+	snprintf(job->err, ERR_LEN, "Unusable descriptor: %s", strerror(errno));
+	return false;
+}
+
+/* Do the work of a parsed job in a child process. Any failure in the library
+ * exits the child, with the reason left in the shared job->err */
+static bool fork_job(struct job *job)
+{
+	rzip_control *control = &job->control;
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid == -1) {
+		snprintf(job->err, ERR_LEN, "Failed to fork: %s", strerror(errno));
+		return false;
+	}
+	if (!pid) {
+		bool ret;
+
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		close(listen_fd);
+		control->library_mode = 0;
+		control->msgerr = NULL;
+		if (DECOMPRESS || TEST_ONLY)
+			ret = decompress_file(control);
+		else
+			ret = compress_file(control);
+		if (!ret)
+			unlink_broken(control);
+		_exit(!ret);
+	}
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			snprintf(job->err, ERR_LEN, "Failed to wait for job: %s", strerror(errno));
+			return false;
+		}
+	}
+	if (WIFEXITED(status) && !WEXITSTATUS(status))
+		return true;
+	if (WIFSIGNALED(status))
+		snprintf(job->err, ERR_LEN, "Job killed by signal %d", WTERMSIG(status));
+	else if (!job->err[0])
+		snprintf(job->err, ERR_LEN, "Failed");
+	return false;
+}
+
+static void run_job(struct job *job, int conn)
+{
+	rzip_control *control = &job->control;
+	double start = stats_time();
+	char reply[ERR_LEN + 8];
+	bool ret = false;
+	int i;
+
+	job->err[0] = '\0';
+	control->inFILE = control->outFILE = NULL;
+	if (!read_request(job, conn))
+		snprintf(job->err, ERR_LEN, "Incomplete request");
+	else if (parse_request(job))
+		ret = fork_job(job);
+	/* The library closes neither end of stdio. Any tmp file it named when
+	 * reading from a descriptor was the child's to clean up */
+	if (control->inFILE)
+		fclose(control->inFILE);
+	if (control->outFILE)
+		fclose(control->outFILE);
+	for (i = 0; i < job->fds; i++) {
+		if (job->fd[i] != -1)
+			close(job->fd[i]);
+	}
+
+	if (ret)
+		snprintf(reply, sizeof(reply), "OK\n");
+	else
+		snprintf(reply, sizeof(reply), "ERROR %s\n", job->err);
+	if (write(conn, reply, strlen(reply)) != (ssize_t)strlen(reply) && verbose)
+		fprintf(stderr, "lrzipd: client went away before the reply\n");
+	if (verbose)
+		fprintf(stderr, "%s %s: %.3fs %s", STDIN ? "-" : control->infile,
+			TEST_ONLY ? "test" : DECOMPRESS ? "decompress" : "compress",
+			stats_time() - start, reply);
+}
+
+static void *job_thread(void *data)
+{
+	struct job *job = data;
+	int conn;
+
+	while (42) {
+		conn = accept(listen_fd, NULL, NULL);
+		if (conn == -1) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				fprintf(stderr, "lrzipd: accept failed: %s\n", strerror(errno));
+			continue;
+		}
+		run_job(job, conn);
+		close(conn);
+	}
+	return NULL;
+}
+
+static struct option long_options[] = {
+	{"jobs",	required_argument,	0,	'j'},
+	{"maxram",	required_argument,	0,	'm'},
+	{"threads",	required_argument,	0,	'p'},
+	{"verbose",	no_argument,	0,	'v'},
+	{"help",	no_argument,	0,	'h'},
+	{0,	0,	0,	0},
+};
+
+int main(int argc, char *argv[])
+{
+	rzip_control *control = &base_control;
+	struct sockaddr_un addr;
+	struct sigaction handler;
+	struct job *job;
+	struct stat st;
+	char *eptr;
+	int c, i;
+
+	if (unlikely(!initialise_control(control)))
+		return 1;
+	eptr = getenv("LRZIP");
+	if (eptr == NULL || !strstr(eptr, "NOCONFIG"))
+		read_config(control);
+
+	while ((c = getopt_long(argc, argv, "hj:m:p:v", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1)
+				failure("Must run at least one job\n");
+			break;
+		case 'm':
+			control->ramsize = strtol(optarg, NULL, 10) * 1024 * 1024 * 100;
+			if (control->ramsize < 1)
+				failure("Invalid maxram %s\n", optarg);
+			break;
+		case 'p':
+			control->threads = atoi(optarg);
+			if (control->threads < 1)
+				failure("Must have at least one thread\n");
+			control->threads_limit = NULL;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage();
+			return c == 'h' ? 0 : 2;
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+		return 2;
+	}
+	sockname = argv[optind];
+	if (strlen(sockname) >= sizeof(addr.sun_path))
+		failure("Socket path %s too long\n", sockname);
+
+	CrcGenerateTable();
+
+	/* Replace a socket left behind by a previous instance, but nothing else */
+	if (!lstat(sockname, &st)) {
+		if (!S_ISSOCK(st.st_mode))
+			failure("%s exists and is not a socket\n", sockname);
+		unlink(sockname);
+	}
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd == -1)
+		fatal("Failed to create socket\n");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockname);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(listen_fd, 64))
+		fatal("Failed to listen on %s\n", sockname);
+
+	sigemptyset(&handler.sa_mask);
+	handler.sa_flags = 0;
+	handler.sa_handler = &sighandler;
+	sigaction(SIGTERM, &handler, 0);
+	sigaction(SIGINT, &handler, 0);
+	/* Clients going away mid reply must not take us with them */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (verbose)
+		fprintf(stderr, "lrzipd listening on %s, %d jobs sharing %d threads and %"PRId64"MB ram\n",
+			sockname, jobs, control->threads, control->ramsize / 1024 / 1024);
+
+	job = calloc(jobs, sizeof(struct job));
+	if (unlikely(!job))
+		fatal("Failed to calloc jobs\n");
+	eptr = mmap(NULL, jobs * ERR_LEN, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (unlikely(eptr == MAP_FAILED))
+		fatal("Failed to mmap job errors\n");
+	for (i = 0; i < jobs; i++)
+		job[i].err = eptr + i * ERR_LEN;
+	for (i = 1; i < jobs; i++) {
+		if (unlikely(!create_pthread(control, &job[i].pthread, NULL, job_thread, &job[i])))
+			fatal_exit(control);
+	}
+	job_thread(&job[0]);
+	return 0;
+}
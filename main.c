@@ -57,13 +57,36 @@
 #include "lrzip_core.h"
 #include "util.h"
 #include "stream.h"
+#include "throttle.h"
 
 /* needed for CRC routines */
 #include "lzma/C/7zCrc.h"
 
 #define MAX_PATH_LEN 4096
 
-static rzip_control base_control, local_control, *control;
+/* The controls themselves live in main() with each file getting its own job
+ * copy. These only point to them for the helpers and the signal handler. */
+static rzip_control *control, *job_control;
+
+/* With --jobs each worker thread takes the next file off the list, running
+ * it with its own copy of the control */
+struct job_worker {
+	pthread_t pthread;
+	rzip_control control;
+	bool active;
+};
+
+static struct job_queue {
+	pthread_mutex_t lock;
+	rzip_control *base;
+	char **files;
+	int entries;
+	int next;
+	int unfinished;
+	int jobs;
+	bool compat;
+	struct job_worker *worker;
+} queue;
 
 static void usage(bool compat)
 {
@@ -83,6 +106,7 @@ static void usage(bool compat)
 	print_output("	-h, -?, --help		show help\n");
 	print_output("	-H, --hash		display md5 hash integrity information\n");
 	print_output("	-i, --info		show compressed file information\n");
+	print_output("	--estimate		predict compressed size and time with each backend, writing nothing\n");
 	if (compat) {
 		print_output("	-L, --license		display software version and license\n");
 		print_output("	-P, --progress		show compression progress\n");
@@ -104,6 +128,12 @@ static void usage(bool compat)
 	print_output("	-o, --outfile filename	specify the output file name and/or path\n");
 	print_output("	-O, --outdir directory	specify the output directory when -o is not used\n");
 	print_output("	-S, --suffix suffix	specify compressed suffix (default '.lrz')\n");
+	print_output("	--no-prealloc		don't reserve disk space for output files before writing them\n");
+	print_output("	--stats-json file	write a JSON performance report line per file to file (- for stderr)\n");
+	print_output("	--trace file		write a chrome trace event timeline of all threads to file\n");
+	print_output("	--metrics file		periodically write prometheus format progress metrics to file\n");
+	print_output("				or to a listening unix socket given as unix:path\n");
+	print_output("	--metrics-interval n	seconds between metrics snapshots (default 5)\n");
 	print_output("Options affecting compression:\n");
 	print_output("	--lzma			lzma compression (default)\n");
 	print_output("	-b, --bzip2		bzip2 compression\n");
@@ -121,12 +151,23 @@ static void usage(bool compat)
 		print_output("	-L, --level level	set lzma/bzip2/gzip compression level (1-9, default 7)\n");
 	print_output("	-N, --nice-level value	Set nice value to value (default %d)\n", compat ? 0 : 19);
 	print_output("	-p, --threads value	Set processor count to override number of threads\n");
+	print_output("	--numa-nodes list	only run threads on these NUMA nodes, eg 0,2-3 (default all)\n");
+	print_output("	--read-limit MB/s	limit the rate of reading input\n");
+	print_output("	--write-limit MB/s	limit the rate of writing output\n");
+	print_output("	--ionice class		io priority class, idle or best-effort[:0-7]\n");
+	print_output("	--cpu-limit percent	limit each thread to running this percent of the time\n");
+	print_output("	--jobs n		process n files at once sharing out threads and ram (0 = one per CPU)\n");
+	print_output("	--files-from file	also process the files listed one per line in file (- for stdin)\n");
 	print_output("	-m, --maxram size	Set maximum available ram in hundreds of MB\n");
 	print_output("				overrides detected amount of available ram\n");
 	print_output("	-T, --threshold		Disable LZ4 compressibility testing\n");
 	print_output("	-U, --unlimited		Use unlimited window size beyond ramsize (potentially much slower)\n");
+	print_output("	--autotune		choose threads, block size and buffers for throughput from\n");
+	print_output("				a calibration of this host cached in ~/.lrzip/profile\n");
 	print_output("	-w, --window size	maximum compression window in hundreds of MB\n");
 	print_output("				default chosen by heuristic dependent on ram and chosen compression\n");
+	print_output("	--min-match n		shortest match rzip looks for, 16 to 64 (default %d)\n", MINIMUM_MATCH);
+	print_output("				larger is faster, smaller finds more in text\n");
 	print_output("\nLRZIP=NOCONFIG environment variable setting can be used to bypass lrzip.conf.\n");
 	print_output("TMP environment variable will be used for storage of temporary files when needed.\n");
 	print_output("TMPDIR may also be stored in lrzip.conf file.\n");
@@ -152,7 +193,7 @@ static void sighandler(int sig __UNUSED__)
 	signal(SIGTTIN, SIG_IGN);
 	signal(SIGTTOU, SIG_IGN);
 	print_err("Interrupted\n");
-	fatal_exit(&local_control);
+	fatal_exit(job_control);
 }
 
 static void show_summary(void)
@@ -164,6 +205,9 @@ static void show_summary(void)
 				      DECOMPRESS ? "DECOMPRESSION" : "COMPRESSION");
 		print_verbose("Threading is %s. Number of CPUs detected: %d\n", control->threads > 1? "ENABLED" : "DISABLED",
 			      control->threads);
+		if (control->threads_limit)
+			print_verbose("Threads limited by %s from %d CPUs online\n",
+				      control->threads_limit, control->cpus_online);
 		print_verbose("Detected %lld bytes ram\n", control->ramsize);
 		print_verbose("Compression level %d\n", control->compression_level);
 		print_verbose("Nice Value: %d\n", control->nice_val);
@@ -218,6 +262,13 @@ static void show_summary(void)
 			print_maxverbose("Storage time in seconds %lld\n", control->secs);
 		if (ENCRYPT)
 			print_maxverbose("Encryption hash loops %lld\n", control->encloops);
+		if (control->stats_json)
+			print_verbose("Writing performance report to %s\n", control->stats_json);
+		if (control->trace_file)
+			print_verbose("Writing timeline trace to %s\n", control->trace_file);
+		if (control->metrics_file)
+			print_verbose("Exporting metrics to %s every %d seconds\n",
+				      control->metrics_file, control->metrics_interval);
 	}
 }
 
@@ -259,6 +310,21 @@ static struct option long_options[] = {
 	{"zpaq",	no_argument,	0,	'z'},
 	{"fast",	no_argument,	0,	'1'},
 	{"best",	no_argument,	0,	'9'},
+	{"stats-json",	required_argument,	0,	'#'},
+	{"trace",	required_argument,	0,	'&'},
+	{"metrics",	required_argument,	0,	'^'},
+	{"metrics-interval",	required_argument,	0,	'%'},
+	{"estimate",	no_argument,	0,	'$'},
+	{"numa-nodes",	required_argument,	0,	'@'},
+	{"read-limit",	required_argument,	0,	'<'},
+	{"write-limit",	required_argument,	0,	'>'},
+	{"ionice",	required_argument,	0,	'~'},
+	{"cpu-limit",	required_argument,	0,	'!'},
+	{"autotune",	no_argument,	0,	'*'},
+	{"jobs",	required_argument,	0,	')'},
+	{"files-from",	required_argument,	0,	'('},
+	{"min-match",	required_argument,	0,	']'},
+	{"no-prealloc",	no_argument,	0,	'['},
 	{0,	0,	0,	0},
 };
 
@@ -270,8 +336,21 @@ static void set_stdout(struct rzip_control *control)
 	register_outputfile(control, control->msgout);
 }
 
+/* Append a copy of name to list, doubling its size as it fills */
+static void add_file(char ***list, int *entries, const char *name)
+{
+	if (!(*entries & (*entries - 1))) {
+		*list = realloc(*list, sizeof(char *) * (*entries ? *entries * 2 : 1));
+		if (unlikely(!*list))
+			fatal("Failed to realloc file list\n");
+	}
+	(*list)[*entries] = strdup(name);
+	if (unlikely(!(*list)[(*entries)++]))
+		fatal("Failed to strdup file name\n");
+}
+
 /* Recursively enter all directories, adding all regular files to the dirlist array */
-static void recurse_dirlist(char *indir, char **dirlist, int *entries)
+static void recurse_dirlist(char *indir, char ***dirlist, int *entries)
 {
 	char fname[MAX_PATH_LEN];
 	struct stat istat;
@@ -296,12 +375,194 @@ static void recurse_dirlist(char *indir, char **dirlist, int *entries)
 			continue;
 		}
 		print_maxverbose("Added file %s\n", fname);
-		*dirlist = realloc(*dirlist, MAX_PATH_LEN * (*entries + 1));
-		strcpy(*dirlist + MAX_PATH_LEN * (*entries)++, fname);
+		add_file(dirlist, entries, fname);
 	}
 	closedir(dirp);
 }
 
+/* Add the names listed one per line in fname, where - is stdin */
+static void read_filelist(const char *fname, char ***list, int *entries)
+{
+	char line[MAX_PATH_LEN];
+	size_t len;
+	FILE *f;
+
+	f = strcmp(fname, "-") ? fopen(fname, "r") : stdin;
+	if (unlikely(!f))
+		failure("Unable to open file list %s\n", fname);
+	while (fgets(line, sizeof(line), f)) {
+		len = strlen(line);
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len)
+			add_file(list, entries, line);
+	}
+	if (f != stdin)
+		fclose(f);
+}
+
+static void show_total_time(struct timeval *start_time)
+{
+	struct timeval end_time;
+	double total_time, seconds;
+	int hours, minutes;
+
+	gettimeofday(&end_time, NULL);
+	total_time = (end_time.tv_sec + (double)end_time.tv_usec / 1000000) -
+		      (start_time->tv_sec + (double)start_time->tv_usec / 1000000);
+	hours = (int)total_time / 3600;
+	minutes = (int)(total_time / 60) % 60;
+	seconds = total_time - hours * 3600 - minutes * 60;
+	print_output("Total time: %02d:%02d:%05.2f\n", hours, minutes, seconds);
+}
+
+static void run_file(rzip_control *control)
+{
+	if (DECOMPRESS || TEST_ONLY)
+		decompress_file(control);
+	else if (INFO)
+		get_fileinfo(control);
+	else if (ESTIMATE)
+		estimate_file(control);
+	else
+		compress_file(control);
+}
+
+/* Refuse to read or write a terminal unless forced */
+static void check_stdio(rzip_control *control, bool compat)
+{
+	if (FORCE_REPLACE)
+		return;
+	if (STDIN && isatty(fileno((FILE *)stdin))) {
+		print_err("Will not read stdin from a terminal. Use -f to override.\n");
+		usage(compat);
+		exit (1);
+	}
+	if (!TEST_ONLY && STDOUT && isatty(fileno((FILE *)stdout)) && !compat) {
+		print_err("Will not write stdout to a terminal. Use -f to override.\n");
+		usage(compat);
+		exit (1);
+	}
+}
+
+static void *job_thread(void *data)
+{
+	struct job_worker *worker = data;
+	rzip_control *control = &worker->control;
+	int share;
+
+	while (42) {
+		pthread_mutex_lock(&queue.lock);
+		if (queue.next >= queue.entries) {
+			pthread_mutex_unlock(&queue.lock);
+			break;
+		}
+		/* Split the threads, ram and bandwidth between the files yet
+		 * to finish, so the last few get the whole budget. Jobs that
+		 * started earlier hold at most the same share each so the sum
+		 * never exceeds the budget. */
+		share = MIN(queue.jobs, queue.unfinished);
+		memcpy(control, queue.base, sizeof(rzip_control));
+		control->infile = queue.files[queue.next++];
+		control->threads = MAX(control->threads / share, 1);
+		control->ramsize /= share;
+		control->read_limit /= share;
+		control->write_limit /= share;
+		setup_ram(control);
+		worker->active = true;
+		pthread_mutex_unlock(&queue.lock);
+
+		check_stdio(control, queue.compat);
+
+		run_file(control);
+
+		pthread_mutex_lock(&queue.lock);
+		worker->active = false;
+		queue.unfinished--;
+		pthread_mutex_unlock(&queue.lock);
+	}
+	return NULL;
+}
+
+/* A failing job exits the whole process, so clean up after the others */
+static void unlink_jobs(void)
+{
+	int i;
+
+	for (i = 0; i < queue.jobs; i++) {
+		if (queue.worker[i].active)
+			unlink_broken(&queue.worker[i].control);
+	}
+}
+
+/* Process all the files named, or the regular files beneath them with -r,
+ * control->jobs at a time */
+static void run_jobs(int argc, char *argv[], bool recurse, bool compat)
+{
+	struct timeval start_time;
+	struct stat istat;
+	int i;
+
+	if (unlikely(STDOUT))
+		failure("Cannot use --jobs with STDIO\n");
+	for (i = 0; i < argc; i++) {
+		if (unlikely(!strcmp(argv[i], "-")))
+			failure("Cannot use --jobs with STDIO\n");
+		if (unlikely(stat(argv[i], &istat)))
+			failure("Failed to stat %s\n", argv[i]);
+		if (recurse) {
+			if (!S_ISDIR(istat.st_mode))
+				failure("%s not a directory, -r recursive needs a directory\n", argv[i]);
+			recurse_dirlist(argv[i], &queue.files, &queue.entries);
+		} else if (!S_ISREG(istat.st_mode)) {
+			failure("lrzip only works directly on regular FILES.\n"
+				"Use -r recursive, lrztar or pipe through tar for compressing directories.\n");
+		} else
+			add_file(&queue.files, &queue.entries, argv[i]);
+	}
+	queue.jobs = MIN(control->jobs, queue.entries);
+	if (!queue.jobs)
+		return;
+	if (queue.jobs > 1) {
+		if (unlikely(ENCRYPT && !control->passphrase))
+			failure("Cannot prompt for passwords with --jobs, give one with -e\n");
+		if (unlikely(control->metrics_file))
+			failure("Cannot export metrics of several jobs at once\n");
+		/* Progress lines of several files would overwrite each other */
+		control->flags &= ~FLAG_SHOW_PROGRESS;
+	}
+	queue.unfinished = queue.entries;
+	queue.base = control;
+	queue.compat = compat;
+
+	control->msgout = stdout;
+	register_outputfile(control, control->msgout);
+	if (CHECK_FILE && !DECOMPRESS) {
+		print_err("Can only check file written on decompression.\n");
+		control->flags &= ~FLAG_CHECK;
+	}
+	setup_ram(control);
+	show_summary();
+	print_verbose("Processing %d files, %d at a time\n", queue.entries, queue.jobs);
+
+	queue.worker = calloc(queue.jobs, sizeof(struct job_worker));
+	if (unlikely(!queue.worker))
+		fatal("Failed to calloc job workers\n");
+	if (unlikely(!init_mutex(control, &queue.lock)))
+		fatal_exit(control);
+	atexit(unlink_jobs);
+
+	gettimeofday(&start_time, NULL);
+	for (i = 0; i < queue.jobs; i++) {
+		if (unlikely(!create_pthread(control, &queue.worker[i].pthread, NULL,
+					     job_thread, &queue.worker[i])))
+			fatal_exit(control);
+	}
+	for (i = 0; i < queue.jobs; i++)
+		join_pthread(control, queue.worker[i].pthread, NULL);
+	show_total_time(&start_time);
+}
+
 static const char *loptions = "bcCdDefghHiKlL:nN:o:O:p:PqQrS:tTUm:vVw:z?";
 static const char *coptions = "bcCdefghHikKlLnN:o:O:p:PrS:tTUm:vVw:z?123456789";
 
@@ -309,17 +570,18 @@ int main(int argc, char *argv[])
 {
 	bool lrzcat = false, compat = false, recurse = false;
 	bool options_file = false, conf_file_compression_set = false; /* for environment and tracking of compression setting */
-	struct timeval start_time, end_time;
+	rzip_control base_control, local_control;
+	struct timeval start_time;
 	struct sigaction handler;
-	double seconds,total_time; // for timers
+	double limit;
 	bool nice_set = false;
 	int c, i;
-	int hours,minutes;
 	extern int optind;
 	char *eptr, *av; /* for environment */
 	char *endptr = NULL;
+	char *files_from = NULL;
 
-        control = &base_control;
+	control = job_control = &base_control;
 
 	initialise_control(control);
 
@@ -388,6 +650,64 @@ int main(int argc, char *argv[])
 		case '/':							/* LZMA Compress selected */
 			control->flags &= ~FLAG_NOT_LZMA;			/* clear alternate compression flags */
 			break;
+		case '#':
+			control->stats_json = optarg;
+			break;
+		case '&':
+			control->trace_file = optarg;
+			break;
+		case '^':
+			control->metrics_file = optarg;
+			break;
+		case '%':
+			control->metrics_interval = strtol(optarg, &endptr, 10);
+			if (control->metrics_interval < 1 || (endptr && *endptr))
+				failure("Invalid metrics interval %s\n", optarg);
+			break;
+		case '$':
+			control->flags |= FLAG_ESTIMATE;
+			break;
+		case '@':
+			control->numa_nodes = optarg;
+			break;
+		case '<':
+		case '>':
+			limit = strtod(optarg, &endptr);
+			if (limit <= 0 || *endptr)
+				failure("Invalid bandwidth limit %s MB/s\n", optarg);
+			if (c == '<')
+				control->read_limit = limit * 1024 * 1024;
+			else
+				control->write_limit = limit * 1024 * 1024;
+			break;
+		case '~':
+			if (!parse_ionice(control, optarg))
+				failure("Invalid io priority %s, must be idle or best-effort[:0-7]\n", optarg);
+			break;
+		case '!':
+			control->cpu_limit = strtol(optarg, &endptr, 10);
+			if (control->cpu_limit < 1 || control->cpu_limit > 100 || *endptr)
+				failure("CPU limit must be a percentage from 1 to 100\n");
+			break;
+		case '*':
+			control->flags |= FLAG_AUTOTUNE;
+			break;
+		case ')':
+			control->jobs = strtol(optarg, &endptr, 10);
+			if (control->jobs < 0 || *endptr)
+				failure("Invalid number of jobs %s\n", optarg);
+			break;
+		case '(':
+			files_from = optarg;
+			break;
+		case '[':
+			control->flags |= FLAG_NO_PREALLOC;
+			break;
+		case ']':
+			control->min_match = strtol(optarg, &endptr, 10);
+			if (control->min_match < MIN_MATCH_LOW || control->min_match > MIN_MATCH_HIGH || *endptr)
+				failure("Minimum match must be between %d and %d\n", MIN_MATCH_LOW, MIN_MATCH_HIGH);
+			break;
 		case 'c':
 			if (compat) {
 				control->flags |= FLAG_KEEP_FILES;
@@ -482,6 +802,7 @@ int main(int argc, char *argv[])
 				failure("Must have at least one thread\n");
 			if (*endptr)
 				failure("Extra characters after number of threads: \'%s\'\n", endptr);
+			control->threads_limit = NULL;
 			break;
 		case 'P':
 			control->flags |= FLAG_SHOW_PROGRESS;
@@ -564,6 +885,17 @@ int main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if (files_from) {
+		char **files = NULL;
+		int entries = 0;
+
+		for (i = 0; i < argc; i++)
+			add_file(&files, &entries, argv[i]);
+		read_filelist(files_from, &files, &entries);
+		argc = entries;
+		argv = files;
+	}
+
 	if (control->outname) {
 		if (argc > 1)
 			failure("Cannot specify output filename with more than 1 file\n");
@@ -581,7 +913,7 @@ int main(int argc, char *argv[])
 		control->window = 0;
 	}
 
-	if (argc < 1)
+	if (argc < 1 && !files_from)
 		control->flags |= FLAG_STDIN;
 
 	if (UNLIMITED && STDIN) {
@@ -591,6 +923,22 @@ int main(int argc, char *argv[])
 
 	setup_overhead(control);
 
+	/* Each file processed appends its own report line so start afresh */
+	if (control->stats_json && strcmp(control->stats_json, "-")) {
+		FILE *f = fopen(control->stats_json, "w");
+
+		if (unlikely(!f))
+			fatal("Failed to create stats file %s\n", control->stats_json);
+		fclose(f);
+	}
+	if (control->trace_file) {
+		FILE *f = fopen(control->trace_file, "w");
+
+		if (unlikely(!f))
+			fatal("Failed to create trace file %s\n", control->trace_file);
+		fclose(f);
+	}
+
 	/* Set the main nice value to half that of the backend threads since
 	 * the rzip stage is usually the rate limiting step */
 	control->current_priority = getpriority(PRIO_PROCESS, 0);
@@ -611,9 +959,25 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (!control->jobs)
+		control->jobs = control->threads;
+	/* Output to stdout has to come out one file after another, in order */
+	if (lrzcat || (control->outname && !strcmp(control->outname, "-")))
+		control->jobs = 1;
+	if (control->jobs > 1 && !STDIN && !INFO && !ESTIMATE) {
+		/* Implement signal handler only once flags are set */
+		sigemptyset(&handler.sa_mask);
+		handler.sa_flags = 0;
+		handler.sa_handler = &sighandler;
+		sigaction(SIGTERM, &handler, 0);
+		sigaction(SIGINT, &handler, 0);
+		run_jobs(argc, argv, recurse, compat);
+		return 0;
+	}
+
 	/* One extra iteration for the case of no parameters means we will default to stdin/out */
 	for (i = 0; i <= argc; i++) {
-		char *dirlist = NULL, *infile = NULL;
+		char **dirlist = NULL, *infile = NULL;
 		int direntries = 0, curentry = 0;
 
 		if (i < argc)
@@ -647,13 +1011,15 @@ int main(int argc, char *argv[])
 
 		if (INFO && STDIN)
 			failure("Will not get file info from STDIN\n");
+		if (ESTIMATE && STDIN)
+			failure("Cannot estimate from STDIN\n");
 recursion:
 		if (recurse) {
 			if (curentry >= direntries) {
 				infile = NULL;
 				continue;
 			}
-			infile = dirlist + MAX_PATH_LEN * curentry++;
+			infile = dirlist[curentry++];
 		}
 		control->infile = infile;
 
@@ -684,18 +1050,7 @@ recursion:
 		sigaction(SIGTERM, &handler, 0);
 		sigaction(SIGINT, &handler, 0);
 
-		if (!FORCE_REPLACE) {
-			if (STDIN && isatty(fileno((FILE *)stdin))) {
-				print_err("Will not read stdin from a terminal. Use -f to override.\n");
-				usage(compat);
-				exit (1);
-			}
-			if (!TEST_ONLY && STDOUT && isatty(fileno((FILE *)stdout)) && !compat) {
-				print_err("Will not write stdout to a terminal. Use -f to override.\n");
-				usage(compat);
-				exit (1);
-			}
-		}
+		check_stdio(control, compat);
 
 		if (CHECK_FILE) {
 			if (!DECOMPRESS) {
@@ -716,22 +1071,11 @@ recursion:
 			failure("Unable to work from STDIO while reading password\n");
 
 		memcpy(&local_control, &base_control, sizeof(rzip_control));
-		if (DECOMPRESS || TEST_ONLY)
-			decompress_file(&local_control);
-		else if (INFO)
-			get_fileinfo(&local_control);
-		else
-			compress_file(&local_control);
-
-		/* compute total time */
-		gettimeofday(&end_time, NULL);
-		total_time = (end_time.tv_sec + (double)end_time.tv_usec / 1000000) -
-			      (start_time.tv_sec + (double)start_time.tv_usec / 1000000);
-		hours = (int)total_time / 3600;
-		minutes = (int)(total_time / 60) % 60;
-		seconds = total_time - hours * 3600 - minutes * 60;
+		job_control = &local_control;
+		run_file(&local_control);
+
 		if (!INFO)
-			print_output("Total time: %02d:%02d:%05.2f\n", hours, minutes, seconds);
+			show_total_time(&start_time);
 		if (recurse)
 			goto recursion;
 	}
@@ -0,0 +1,614 @@
+/*
+   Copyright (C) 2022 Con Kolivas
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Microbenchmarks run by make microbench. Times the hot kernels one at a
+ * time over an in memory buffer: the hash search and its tag, insert and
+ * match helpers, the checksums, the lz4 compressibility test, every backend
+ * and the encryption, reporting ns and cycles per byte for each. Every
+ * kernel is repeated for a minimum time and the fastest run is reported. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+#endif
+
+#include "lrzip_core.h"
+#include "rzip.h"
+#include "stream.h"
+#include "util.h"
+#include "stats.h"
+#include "md5.h"
+/* needed for CRC routines */
+#include "lzma/C/7zCrc.h"
+
+#define MAX_LIST	16
+#define TAIL		64	/* Past the end of rzip's minimum match */
+
+struct ctx {
+	rzip_control control;
+	struct rzip_state *st;
+	char path[PATH_MAX];
+	char outpath[PATH_MAX + 8];
+	uchar *buf;	/* Text with long range repeats */
+	uchar *rnd;	/* Incompressible */
+	uchar *work;
+	uchar *cbuf;
+	i64 len;
+	i64 clen;
+	uchar c_type;
+	int level;
+	bool sliding;
+	double secs;	/* Set by kernels that time only part of their run */
+};
+
+struct kernel {
+	char name[48];
+	void (*prep)(struct ctx *);
+	i64 (*run)(struct ctx *);
+};
+
+static double min_time = 0.5;
+static bool csv;
+static volatile i64 sink;
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* Run a kernel until min_time has passed and report its fastest run */
+static void measure(struct ctx *ctx, struct kernel *k)
+{
+	double best = 1e30, best_cycles = 0, total = 0, start;
+	i64 bytes = 0;
+	uint64_t c;
+	int runs = 0;
+
+	while (!runs || total < min_time) {
+		double secs;
+		i64 done;
+
+		if (k->prep)
+			k->prep(ctx);
+		ctx->secs = 0;
+		start = stats_time();
+		c = cycles();
+		done = k->run(ctx);
+		c = cycles() - c;
+		secs = stats_time() - start;
+		total += secs;
+		runs++;
+		if (done < 0) {
+			fprintf(stderr, "%s failed\n", k->name);
+			return;
+		}
+		/* Scale the cycles down to the part that was timed */
+		if (ctx->secs > 0) {
+			c = c * (ctx->secs / secs);
+			secs = ctx->secs;
+		}
+		if (done && secs / done < best / MAX(bytes, 1)) {
+			best = secs;
+			best_cycles = c;
+			bytes = done;
+		}
+	}
+	if (!bytes)
+		return;
+	if (csv)
+		printf("%s,%lld,%d,%.3f,%.3f,%.2f\n", k->name, (long long)bytes, runs,
+		       best * 1e9 / bytes, best_cycles / bytes, bytes / best / 1048576);
+	else if (best_cycles)
+		printf("%-32s %10lld %6d %10.3f %10.3f %10.2f\n", k->name, (long long)bytes,
+		       runs, best * 1e9 / bytes, best_cycles / bytes, bytes / best / 1048576);
+	else
+		printf("%-32s %10lld %6d %10.3f %10s %10.2f\n", k->name, (long long)bytes,
+		       runs, best * 1e9 / bytes, "-", bytes / best / 1048576);
+	fflush(stdout);
+}
+
+/* Text from a skewed vocabulary for the first half, and the second half
+ * repeating the first with a changed byte every 4k, so there is short range
+ * redundancy for the backends and long range matches for rzip to find */
+static void gen_data(struct ctx *ctx)
+{
+	static const char *words[] = {
+		"the", "of", "and", "compression", "window", "to", "in", "a",
+		"match", "is", "that", "lrzip", "for", "it", "buffer", "with",
+		"as", "stream", "on", "be", "at", "hash", "by", "this"
+	};
+	uint64_t r = 0x9e3779b97f4a7c15ull;
+	i64 i = 0, half = ctx->len / 2;
+
+	while (i < half) {
+		const char *w;
+		int wlen;
+
+		r ^= r << 13;
+		r ^= r >> 7;
+		r ^= r << 17;
+		w = words[(r & 0xff) * (r >> 8 & 0xff) * 24 >> 16];
+		wlen = MIN((i64)strlen(w), half - i);
+		memcpy(ctx->buf + i, w, wlen);
+		i += wlen;
+		if (i < half)
+			ctx->buf[i++] = (r >> 20 & 0xf) ? ' ' : '\n';
+	}
+	for (i = half; i < ctx->len; i++) {
+		ctx->buf[i] = ctx->buf[i - half];
+		if (!(i & 4095))
+			ctx->buf[i] ^= 0x55;
+	}
+	for (i = 0; i < ctx->len; i++) {
+		r ^= r << 13;
+		r ^= r >> 7;
+		r ^= r << 17;
+		ctx->rnd[i] = r;
+	}
+}
+
+static bool setup_control(rzip_control *control)
+{
+	memset(control, 0, sizeof(*control));
+	if (!initialise_control(control))
+		return false;
+	control->flags &= ~FLAG_SHOW_PROGRESS;
+	control->flags |= FLAG_FORCE_REPLACE;
+	control->msgout = NULL;
+	control->threads = 1;
+	setup_overhead(control);
+	setup_ram(control);
+	return init_mutex(control, &control->control_lock);
+}
+
+/* The whole of hash_search including its output and checksums, run through
+ * rzip_fd with no backend compression and timed by the per chunk stats
+ * which exclude any time spent waiting on the backend threads */
+static i64 run_hash_search(struct ctx *ctx)
+{
+	rzip_control control;
+	int fd_in, fd_out, i;
+
+	if (!setup_control(&control))
+		return -1;
+	control.flags |= FLAG_NO_COMPRESS;
+	control.compression_level = ctx->level;
+	control.infile = ctx->path;
+	control.stats_json = "-";
+	/* One chunk covering the file, mmapped whole or a quarter at a time */
+	control.window = 1;
+	if (ctx->sliding) {
+		control.maxram = ctx->len / 4;
+		round_to_page(&control.maxram);
+	} else
+		control.maxram = MAX(control.maxram, ctx->len);
+	fd_in = open(ctx->path, O_RDONLY);
+	fd_out = open(ctx->outpath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd_in == -1 || fd_out == -1 || !stats_init(&control))
+		return -1;
+	control.fd_out = fd_out;
+	rzip_fd(&control, fd_in, fd_out);
+	for (i = 0; i < control.stats->chunks; i++)
+		ctx->secs += control.stats->chunk[i].rzip_wall;
+	stats_free(&control);
+	close(fd_in);
+	close(fd_out);
+	unlink(ctx->outpath);
+	free(control.tmpdir);
+	return ctx->len;
+}
+
+static i64 run_next_tag(struct ctx *ctx)
+{
+	rzip_control *control = &ctx->control;
+	i64 p, end = ctx->len - TAIL;
+	tag t = bench_full_tag(control, ctx->st, 0);
+
+	for (p = 1; p < end; p++)
+		bench_next_tag(control, ctx->st, p, &t);
+	sink = t;
+	return end;
+}
+
+static void prep_hash(struct ctx *ctx)
+{
+	bench_clear_hash(ctx->st);
+}
+
+/* Insert as hash_search does until the table would need cleaning */
+static i64 run_insert_hash(struct ctx *ctx)
+{
+	rzip_control *control = &ctx->control;
+	struct rzip_state *st = ctx->st;
+	i64 p, end = ctx->len - TAIL;
+	tag t = bench_full_tag(control, st, 0);
+
+	for (p = 1; p < end; p++) {
+		bench_next_tag(control, st, p, &t);
+		if ((t & st->minimum_tag_mask) != st->minimum_tag_mask)
+			continue;
+		if (++st->hash_count > st->hash_limit)
+			break;
+		bench_insert_hash(st, t, p);
+	}
+	return p;
+}
+
+/* Look up every candidate position against a table filled by insert_hash */
+static i64 run_find_best_match(struct ctx *ctx)
+{
+	rzip_control *control = &ctx->control;
+	struct rzip_state *st = ctx->st;
+	i64 p, end = ctx->len - TAIL, offset, reverse, total = 0;
+	tag t = bench_full_tag(control, st, 0);
+
+	for (p = 1; p < end; p++) {
+		bench_next_tag(control, st, p, &t);
+		if ((t & st->minimum_tag_mask) != st->minimum_tag_mask)
+			continue;
+		total += bench_find_best_match(control, st, t, p, end, &offset, &reverse);
+	}
+	sink = total;
+	return end;
+}
+
+/* Extend matches between the two halves, reporting bytes compared */
+static i64 run_match_len(struct ctx *ctx)
+{
+	rzip_control *control = &ctx->control;
+	i64 p, half = ctx->len / 2, rev, total = 0;
+
+	ctx->st->last_match = 0;
+	for (p = half + 2048; p < ctx->len; p += 4096)
+		total += bench_single_match_len(control, ctx->st, p, p - half, ctx->len, &rev);
+	return total;
+}
+
+static i64 run_crc(struct ctx *ctx)
+{
+	sink = CrcUpdate(0, ctx->buf, ctx->len);
+	return ctx->len;
+}
+
+static i64 run_md5(struct ctx *ctx)
+{
+	struct md5_ctx md5;
+	uchar res[MD5_DIGEST_SIZE];
+
+	md5_init_ctx(&md5);
+	md5_process_bytes(ctx->buf, ctx->len, &md5);
+	md5_finish_ctx(&md5, res);
+	sink = res[0];
+	return ctx->len;
+}
+
+/* Worst case where every test length is tried and fails, up to the
+ * largest test of one stream buffer */
+static i64 run_lz4_compresses(struct ctx *ctx)
+{
+	sink = trial_lz4_compresses(&ctx->control, ctx->rnd, ctx->len);
+	return MIN(ctx->len, STREAM_BUFSIZE);
+}
+
+static void prep_compress(struct ctx *ctx)
+{
+	free(ctx->work);
+	ctx->work = malloc(ctx->len);
+	if (!ctx->work) {
+		fprintf(stderr, "Failed to malloc work buffer\n");
+		exit(1);
+	}
+	memcpy(ctx->work, ctx->buf, ctx->len);
+}
+
+static i64 run_compress(struct ctx *ctx)
+{
+	rzip_control *control = &ctx->control;
+
+	ctx->clen = trial_compress_buf(control, ctx->c_type, &ctx->work, ctx->len);
+	if (ctx->clen < 0)
+		return -1;
+	return ctx->len;
+}
+
+static void prep_decompress(struct ctx *ctx)
+{
+	free(ctx->work);
+	ctx->work = malloc(ctx->clen);
+	if (!ctx->work) {
+		fprintf(stderr, "Failed to malloc work buffer\n");
+		exit(1);
+	}
+	memcpy(ctx->work, ctx->cbuf, ctx->clen);
+}
+
+static i64 run_decompress(struct ctx *ctx)
+{
+	rzip_control *control = &ctx->control;
+
+	if (!trial_decompress_buf(control, ctx->c_type, &ctx->work, ctx->clen, ctx->len))
+		return -1;
+	return ctx->len;
+}
+
+static void prep_crypt(struct ctx *ctx)
+{
+	if (!ctx->work)
+		prep_compress(ctx);
+}
+
+static i64 run_encrypt(struct ctx *ctx)
+{
+	static const uchar salt[SALT_LEN] = "microbnc";
+
+	if (!lrz_encrypt(&ctx->control, ctx->work, ctx->len, salt))
+		return -1;
+	return ctx->len;
+}
+
+static i64 run_decrypt(struct ctx *ctx)
+{
+	static const uchar salt[SALT_LEN] = "microbnc";
+
+	if (!lrz_decrypt(&ctx->control, ctx->work, ctx->len, salt))
+		return -1;
+	return ctx->len;
+}
+
+static bool selected(const char *name, char **filters, int nfilters)
+{
+	int i;
+
+	if (!nfilters)
+		return true;
+	for (i = 0; i < nfilters; i++)
+		if (strstr(name, filters[i]))
+			return true;
+	return false;
+}
+
+static int split_list(char *arg, char **list)
+{
+	char *tok, *save = NULL;
+	int n = 0;
+
+	for (tok = strtok_r(arg, ",", &save); tok && n < MAX_LIST; tok = strtok_r(NULL, ",", &save))
+		list[n++] = tok;
+	return n;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"	-s size		buffer size in MB (default 8)\n"
+		"	-L list		rzip levels for the hash kernels (default 1,5,7,9)\n"
+		"	-b list		backends from lzo,gzip,bzip2,lzma,zpaq (default all)\n"
+		"	-k list		only run kernels whose names contain one of these\n"
+		"	-t seconds	minimum time to repeat each kernel (default 0.5)\n"
+		"	-f csv		output CSV instead of a table\n"
+		"	-T dir		directory for temporary files (default .)\n"
+		"Each list is comma separated.\n", name);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct {
+		const char *name;
+		uchar c_type;
+	} backends[] = {
+		{ "lzo", CTYPE_LZO },
+		{ "gzip", CTYPE_GZIP },
+		{ "bzip2", CTYPE_BZIP2 },
+		{ "lzma", CTYPE_LZMA },
+		{ "zpaq", CTYPE_ZPAQ },
+	};
+	char level_arg[64] = "1,5,7,9", backend_arg[64] = "lzo,gzip,bzip2,lzma,zpaq";
+	char filter_arg[256] = "", *levels[MAX_LIST], *backend_list[MAX_LIST], *filters[MAX_LIST];
+	int nlevels, nbackends, nfilters, size_mb = 8, c, i, j, fd;
+	uchar hash[HASH_LEN], salt_pass[] = "microbench";
+	const char *tmpdir = ".";
+	struct kernel k;
+	struct ctx *ctx;
+
+	while ((c = getopt(argc, argv, "s:L:b:k:t:f:T:h")) != -1) {
+		switch (c) {
+		case 's':
+			size_mb = atoi(optarg);
+			break;
+		case 'L':
+			strncpy(level_arg, optarg, sizeof(level_arg) - 1);
+			break;
+		case 'b':
+			strncpy(backend_arg, optarg, sizeof(backend_arg) - 1);
+			break;
+		case 'k':
+			strncpy(filter_arg, optarg, sizeof(filter_arg) - 1);
+			break;
+		case 't':
+			min_time = atof(optarg);
+			break;
+		case 'f':
+			csv = !strcmp(optarg, "csv");
+			break;
+		case 'T':
+			tmpdir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	nlevels = split_list(level_arg, levels);
+	nbackends = split_list(backend_arg, backend_list);
+	nfilters = split_list(filter_arg, filters);
+	if (size_mb < 1)
+		usage(argv[0]);
+
+	CrcGenerateTable();
+	ctx = calloc(sizeof(*ctx), 1);
+	if (!ctx || !setup_control(&ctx->control))
+		return 1;
+	ctx->len = (i64)size_mb * 1024 * 1024;
+	ctx->buf = malloc(ctx->len);
+	ctx->rnd = malloc(ctx->len);
+	if (!ctx->buf || !ctx->rnd)
+		return 1;
+	gen_data(ctx);
+	memset(hash, 0x5a, sizeof(hash));
+	ctx->control.hash = hash;
+	ctx->control.salt_pass = salt_pass;
+	ctx->control.salt_pass_len = sizeof(salt_pass) - 1;
+
+	snprintf(ctx->path, sizeof(ctx->path), "%s/microbench.XXXXXX", tmpdir);
+	fd = mkstemp(ctx->path);
+	if (fd == -1 || write(fd, ctx->buf, ctx->len) != ctx->len) {
+		fprintf(stderr, "Failed to write %s\n", ctx->path);
+		return 1;
+	}
+	close(fd);
+	snprintf(ctx->outpath, sizeof(ctx->outpath), "%s.out", ctx->path);
+
+	if (csv)
+		printf("kernel,bytes,runs,ns_per_byte,cycles_per_byte,mb_per_second\n");
+	else
+		printf("%-32s %10s %6s %10s %10s %10s\n", "kernel", "bytes", "runs",
+		       "ns/byte", "cycles/byte", "MB/s");
+
+	for (i = 0; i < nlevels; i++) {
+		ctx->level = atoi(levels[i]);
+		if (ctx->level < 1 || ctx->level > 9)
+			usage(argv[0]);
+		for (j = 0; j < 2; j++) {
+			ctx->sliding = j;
+			snprintf(k.name, sizeof(k.name), "hash_search %s L%d", j ? "sliding" : "single", ctx->level);
+			k.prep = NULL;
+			k.run = run_hash_search;
+			if (selected(k.name, filters, nfilters))
+				measure(ctx, &k);
+		}
+
+		ctx->st = sample_rzip_state(&ctx->control, ctx->buf, ctx->len, ctx->level);
+		if (!ctx->st)
+			return 1;
+		snprintf(k.name, sizeof(k.name), "next_tag L%d", ctx->level);
+		k.prep = NULL;
+		k.run = run_next_tag;
+		if (selected(k.name, filters, nfilters))
+			measure(ctx, &k);
+		snprintf(k.name, sizeof(k.name), "insert_hash L%d", ctx->level);
+		k.prep = prep_hash;
+		k.run = run_insert_hash;
+		if (selected(k.name, filters, nfilters))
+			measure(ctx, &k);
+		snprintf(k.name, sizeof(k.name), "find_best_match L%d", ctx->level);
+		k.prep = NULL;
+		k.run = run_find_best_match;
+		if (selected(k.name, filters, nfilters)) {
+			prep_hash(ctx);
+			run_insert_hash(ctx);
+			measure(ctx, &k);
+		}
+		free_sample_rzip_state(ctx->st);
+	}
+
+	ctx->st = sample_rzip_state(&ctx->control, ctx->buf, ctx->len, 7);
+	if (!ctx->st)
+		return 1;
+	strcpy(k.name, "single_match_len");
+	k.prep = NULL;
+	k.run = run_match_len;
+	if (selected(k.name, filters, nfilters))
+		measure(ctx, &k);
+	free_sample_rzip_state(ctx->st);
+
+	strcpy(k.name, "CrcUpdate");
+	k.run = run_crc;
+	if (selected(k.name, filters, nfilters))
+		measure(ctx, &k);
+	strcpy(k.name, "md5_process_bytes");
+	k.run = run_md5;
+	if (selected(k.name, filters, nfilters))
+		measure(ctx, &k);
+	strcpy(k.name, "lz4_compresses incompressible");
+	k.run = run_lz4_compresses;
+	if (selected(k.name, filters, nfilters))
+		measure(ctx, &k);
+
+	for (i = 0; i < nbackends; i++) {
+		for (j = 0; j < (int)(sizeof(backends) / sizeof(backends[0])); j++)
+			if (!strcmp(backend_list[i], backends[j].name))
+				break;
+		if (j == sizeof(backends) / sizeof(backends[0]))
+			usage(argv[0]);
+		ctx->c_type = backends[j].c_type;
+		snprintf(k.name, sizeof(k.name), "%s_compress_buf", backends[j].name);
+		k.prep = prep_compress;
+		k.run = run_compress;
+		if (!selected(k.name, filters, nfilters) &&
+		    !selected(backends[j].name, filters, nfilters))
+			continue;
+		measure(ctx, &k);
+		if (ctx->clen <= 0 || ctx->clen >= ctx->len) {
+			fprintf(stderr, "%s left the buffer uncompressed\n", backends[j].name);
+			continue;
+		}
+		/* Keep the compressed buffer as the source for decompression */
+		ctx->cbuf = ctx->work;
+		ctx->work = NULL;
+		snprintf(k.name, sizeof(k.name), "%s_decompress_buf", backends[j].name);
+		k.prep = prep_decompress;
+		k.run = run_decompress;
+		measure(ctx, &k);
+		if (memcmp(ctx->work, ctx->buf, ctx->len))
+			fprintf(stderr, "%s did not round trip\n", backends[j].name);
+		free(ctx->cbuf);
+		ctx->cbuf = NULL;
+	}
+
+	free(ctx->work);
+	ctx->work = NULL;
+	strcpy(k.name, "lrz_crypt encrypt");
+	k.prep = prep_crypt;
+	k.run = run_encrypt;
+	if (selected(k.name, filters, nfilters))
+		measure(ctx, &k);
+	strcpy(k.name, "lrz_crypt decrypt");
+	k.run = run_decrypt;
+	if (selected(k.name, filters, nfilters))
+		measure(ctx, &k);
+
+	unlink(ctx->path);
+	free(ctx->work);
+	free(ctx->buf);
+	free(ctx->rnd);
+	free(ctx->control.tmpdir);
+	free(ctx);
+	return 0;
+}
@@ -0,0 +1,231 @@
+/*
+   Copyright (C) 2022 Con Kolivas
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Placement of threads and their memory on NUMA machines. The rzip thread
+ * runs on the first node so that the hash table and input it first touches
+ * are local to it, while backend threads are spread round robin over the
+ * nodes, each preferring memory from its own node. The topology is read from
+ * sysfs and the memory policy set with the raw syscalls so there is no
+ * dependency on libnuma. Everything here is a no-op unless control->numa is
+ * set, which only happens on linux with more than one usable node or when
+ * --numa-nodes is given. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef __linux
+# include <sched.h>
+# include <sys/syscall.h>
+#endif
+
+#include "numa.h"
+#include "util.h"
+
+#ifdef __linux
+
+#define MAX_NODES	64 /* Fits the node mask in one unsigned long */
+
+#ifndef MPOL_DEFAULT
+# define MPOL_DEFAULT	0
+# define MPOL_PREFERRED	1
+#endif
+#ifndef MPOL_MF_MOVE
+# define MPOL_MF_MOVE	(1 << 1)
+#endif
+
+struct numa_nodes {
+	int count;
+	int id[MAX_NODES];		/* Kernel node numbers */
+	cpu_set_t cpus[MAX_NODES];	/* CPUs of each node we may run on */
+	cpu_set_t allowed;		/* Affinity to restore when done */
+};
+
+/* Parse a kernel style list such as 0-3,8,10-11 into set */
+static bool parse_list(const char *s, cpu_set_t *set)
+{
+	long lo, hi;
+	char *end;
+
+	CPU_ZERO(set);
+	while (*s && *s != '\n') {
+		lo = hi = strtol(s, &end, 10);
+		if (end == s || lo < 0)
+			return false;
+		if (*end == '-') {
+			s = end + 1;
+			hi = strtol(s, &end, 10);
+			if (end == s || hi < lo)
+				return false;
+		}
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			CPU_SET(lo, set);
+		s = end;
+		if (*s == ',')
+			s++;
+		else if (*s && *s != '\n')
+			return false;
+	}
+	return true;
+}
+
+static bool read_list(const char *path, cpu_set_t *set)
+{
+	char line[4096];
+	bool ret;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return false;
+	ret = fgets(line, sizeof(line), f) && parse_list(line, set);
+	fclose(f);
+	return ret;
+}
+
+bool nodes_init(rzip_control *control)
+{
+	cpu_set_t online, want, cpus;
+	struct numa_nodes *numa;
+	char path[64];
+	int node;
+
+	if (control->numa)
+		return true;
+	if (control->numa_nodes && !parse_list(control->numa_nodes, &want))
+		fatal_return(("Invalid --numa-nodes list %s\n", control->numa_nodes), false);
+	if (!read_list("/sys/devices/system/node/online", &online)) {
+		if (control->numa_nodes)
+			print_err("Warning, no NUMA topology found, ignoring --numa-nodes\n");
+		return true;
+	}
+	numa = calloc(sizeof(*numa), 1);
+	if (unlikely(!numa))
+		fatal_return(("Failed to calloc numa in nodes_init\n"), false);
+	if (unlikely(sched_getaffinity(0, sizeof(numa->allowed), &numa->allowed))) {
+		dealloc(numa);
+		return true;
+	}
+	for (node = 0; node < MAX_NODES; node++) {
+		if (!CPU_ISSET(node, &online))
+			continue;
+		if (control->numa_nodes && !CPU_ISSET(node, &want))
+			continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		if (!read_list(path, &cpus))
+			continue;
+		/* Respect any affinity or cpuset we were started with */
+		CPU_AND(&cpus, &cpus, &numa->allowed);
+		if (!CPU_COUNT(&cpus))
+			continue;
+		numa->id[numa->count] = node;
+		numa->cpus[numa->count++] = cpus;
+	}
+	if (control->numa_nodes && !numa->count) {
+		dealloc(numa);
+		fatal_return(("None of --numa-nodes %s have usable CPUs\n", control->numa_nodes), false);
+	}
+	/* Placement only matters with more than one node unless the user
+	 * asked to be kept to a given node */
+	if (numa->count < 2 && !control->numa_nodes) {
+		dealloc(numa);
+		return true;
+	}
+	print_verbose("Placing threads on %d NUMA node%s\n", numa->count, numa->count > 1 ? "s" : "");
+	control->numa = numa;
+	return true;
+}
+
+/* Restore the calling thread, which was bound as the rzip/runzip thread */
+void nodes_free(rzip_control *control)
+{
+	struct numa_nodes *numa = control->numa;
+
+	if (!numa)
+		return;
+	sched_setaffinity(0, sizeof(numa->allowed), &numa->allowed);
+	syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+	dealloc(control->numa);
+}
+
+/* Run the calling thread on the node for thread, and prefer memory from that
+ * node for everything it first touches from now on. Thread 0 is the rzip or
+ * runzip thread. Failure only costs performance so is not fatal. */
+void nodes_bind_thread(rzip_control *control, int thread)
+{
+	struct numa_nodes *numa = control->numa;
+	unsigned long mask;
+	int n;
+
+	if (!numa)
+		return;
+	n = thread % numa->count;
+	mask = 1ul << numa->id[n];
+	if (unlikely(sched_setaffinity(0, sizeof(numa->cpus[n]), &numa->cpus[n])))
+		print_maxverbose("Unable to set affinity of thread %d to node %d\n", thread, numa->id[n]);
+	if (unlikely(syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, MAX_NODES + 1)))
+		print_maxverbose("Unable to set memory policy of thread %d to node %d\n", thread, numa->id[n]);
+}
+
+/* Migrate the pages wholly within buf to the node for thread. Used on stream
+ * buffers filled by the rzip thread before a backend thread on another node
+ * makes repeated passes over them. */
+void nodes_move_buffer(rzip_control *control, int thread, void *buf, i64 len)
+{
+	struct numa_nodes *numa = control->numa;
+	uintptr_t start, end;
+	unsigned long mask;
+
+	if (!numa || numa->count < 2)
+		return;
+	start = ((uintptr_t)buf + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+	end = ((uintptr_t)buf + len) & ~(uintptr_t)(PAGE_SIZE - 1);
+	if (end <= start)
+		return;
+	mask = 1ul << numa->id[thread % numa->count];
+	if (unlikely(syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, &mask,
+			     MAX_NODES + 1, MPOL_MF_MOVE)))
+		print_maxverbose("Unable to move buffer to node %d\n", numa->id[thread % numa->count]);
+}
+
+#else /* __linux */
+
+bool nodes_init(rzip_control *control)
+{
+	if (control->numa_nodes)
+		print_err("Warning, NUMA placement is only supported on linux, ignoring --numa-nodes\n");
+	return true;
+}
+
+void nodes_free(rzip_control __maybe_unused *control)
+{
+}
+
+void nodes_bind_thread(rzip_control __maybe_unused *control, int __maybe_unused thread)
+{
+}
+
+void nodes_move_buffer(rzip_control __maybe_unused *control, int __maybe_unused thread,
+		       void __maybe_unused *buf, i64 __maybe_unused len)
+{
+}
+
+#endif /* __linux */
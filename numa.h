@@ -0,0 +1,27 @@
+/*
+   Copyright (C) 2022 Con Kolivas
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef LRZIP_NUMA_H
+#define LRZIP_NUMA_H
+
+#include "lrzip_private.h"
+
+bool nodes_init(rzip_control *control);
+void nodes_free(rzip_control *control);
+void nodes_bind_thread(rzip_control *control, int thread);
+void nodes_move_buffer(rzip_control *control, int thread, void *buf, i64 len);
+
+#endif
@@ -114,6 +114,14 @@ bash > regressiontest.out 2>&1  <<'_EOS'
     lrz -dc testfile.lrz
     ls testfile.lrz
 
+  echo 'Test sparse file round trip'
+    rm -f sparse sparse.lrz
+    truncate -s 8M sparse
+    seq 1000 >> sparse
+    lrz -k sparse
+    lrz -dc sparse.lrz | cmp - sparse && echo OK
+    rm -f sparse sparse.lrz
+
 _EOS
 
 diff regressiontest.good regressiontest.out
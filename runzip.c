@@ -44,6 +44,8 @@
 #include "runzip.h"
 #include "stream.h"
 #include "util.h"
+#include "stats.h"
+#include "numa.h"
 #include "lrzip_core.h"
 /* needed for CRC routines */
 #include "lzma/C/7zCrc.h"
@@ -128,7 +130,7 @@ static i64 seekto_fdinend(rzip_control *control)
 
 	if (!TMP_INBUF)
 		return lseek(control->fd_in, 0, SEEK_END);
-	while ((tmpchar = getchar()) != EOF) {
+	while ((tmpchar = getc(control->inFILE)) != EOF) {
 		control->tmp_inbuf[control->in_len++] = (char)tmpchar;
 		if (unlikely(control->in_len > control->in_maxlen))
 			failure_return(("Trying to read greater than max_len\n"), -1);
@@ -147,6 +149,24 @@ static i64 read_header(rzip_control *control, void *ss, uchar *head)
 	return read_vchars(control, ss, 0, control->chunk_bytes);
 }
 
+static inline void cksum_update(rzip_control *control, uint32 *cksum, uchar *buf, i64 len)
+{
+	double start = 0, cpu = 0;
+
+	if (control->stats) {
+		start = stats_time();
+		cpu = stats_thread_cpu();
+	}
+	if (!HAS_MD5)
+		*cksum = CrcUpdate(*cksum, buf, len);
+	if (!NO_MD5)
+		md5_process_bytes(buf, len, &control->ctx);
+	if (control->stats) {
+		stats_add(control, &control->stats->hash_wall, stats_time() - start);
+		stats_add(control, &control->stats->hash_cpu, stats_thread_cpu() - cpu);
+	}
+}
+
 static i64 unzip_literal(rzip_control *control, void *ss, i64 len, uint32 *cksum)
 {
 	i64 stream_read;
@@ -170,10 +190,7 @@ static i64 unzip_literal(rzip_control *control, void *ss, i64 len, uint32 *cksum
 		fatal_return(("Failed to write literal buffer of size %lld\n", stream_read), -1);
 	}
 
-	if (!HAS_MD5)
-		*cksum = CrcUpdate(*cksum, buf, stream_read);
-	if (!NO_MD5)
-		md5_process_bytes(buf, stream_read, &control->ctx);
+	cksum_update(control, cksum, buf, stream_read);
 
 	dealloc(buf);
 	return stream_read;
@@ -193,7 +210,7 @@ static i64 read_fdhist(rzip_control *control, void *buf, i64 len)
 
 static i64 unzip_match(rzip_control *control, void *ss, i64 len, uint32 *cksum, int chunk_bytes)
 {
-	i64 offset, n, total, cur_pos;
+	i64 offset, n, rep, total, cur_pos;
 	uchar *buf;
 
 	if (unlikely(len < 0))
@@ -216,29 +233,33 @@ static i64 unzip_match(rzip_control *control, void *ss, i64 len, uint32 *cksum,
 	if (unlikely(n < 1))
 		fatal_return(("Failed fd history in unzip_match due to corrupt archive\n"), -1);
 
-	buf = (uchar *)malloc(n);
+	/* A match overlapping itself repeats its first offset bytes, as runs
+	 * of one byte are stored with an offset of 1, so write it out in
+	 * whole multiples of them rather than offset bytes at a time */
+	rep = n;
+	if (offset < len)
+		rep = MAX(MIN(len, 65536) / offset, 1) * offset;
+
+	buf = (uchar *)malloc(rep);
 	if (unlikely(!buf))
-		fatal_return(("Failed to malloc match buffer of size %lld\n", len), -1);
+		fatal_return(("Failed to malloc match buffer of size %lld\n", rep), -1);
 
 	if (unlikely(read_fdhist(control, buf, (size_t)n) != (ssize_t)n)) {
 		dealloc(buf);
 		fatal_return(("Failed to read %d bytes in unzip_match\n", n), -1);
 	}
+	for (; n < rep; n *= 2)
+		memcpy(buf + n, buf, MIN(n, rep - n));
 
 	while (len) {
-		n = MIN(len, offset);
-		if (unlikely(n < 1))
-			fatal_return(("Failed fd history in unzip_match due to corrupt archive\n"), -1);
+		n = MIN(len, rep);
 
 		if (unlikely(write_1g(control, buf, (size_t)n) != (ssize_t)n)) {
 			dealloc(buf);
 			fatal_return(("Failed to write %d bytes in unzip_match\n", n), -1);
 		}
 
-		if (!HAS_MD5)
-			*cksum = CrcUpdate(*cksum, buf, n);
-		if (!NO_MD5)
-			md5_process_bytes(buf, n, &control->ctx);
+		cksum_update(control, cksum, buf, n);
 
 		len -= n;
 		total += n;
@@ -249,6 +270,39 @@ static i64 unzip_match(rzip_control *control, void *ss, i64 len, uint32 *cksum,
 	return total;
 }
 
+/* Recreate a hole from a sparse file by seeking over it when writing to a
+ * file, only writing out zeros when the output is buffered for stdout */
+static i64 unzip_hole(rzip_control *control, void *ss, uint32 *cksum, int chunk_bytes)
+{
+	static const uchar zeros[65536];
+	i64 len, n, total;
+
+	len = read_vchars(control, ss, 0, chunk_bytes);
+	if (unlikely(len < 1))
+		failure_return(("Invalid hole length %lld in unzip_hole\n", len), -1);
+
+	if (!TMP_OUTBUF) {
+		i64 ofs = lseek(control->fd_out, len, SEEK_CUR);
+
+		if (unlikely(ofs == -1))
+			fatal_return(("Failed to seek over hole in unzip_hole\n"), -1);
+		control->sparse_out = true;
+#ifdef FALLOC_FL_PUNCH_HOLE
+		/* Give back the space reserved for the hole. Space past the end
+		 * of a file can't be punched, so extend it over the hole first */
+		if (control->preallocated && !ftruncate(control->fd_out, ofs))
+			fallocate(control->fd_out, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, ofs - len, len);
+#endif
+	}
+	for (total = 0; total < len; total += n) {
+		n = MIN((i64)sizeof(zeros), len - total);
+		if (TMP_OUTBUF && unlikely(write_1g(control, (void *)zeros, n) != n))
+			fatal_return(("Failed to write %lld bytes in unzip_hole\n", n), -1);
+		cksum_update(control, cksum, (uchar *)zeros, n);
+	}
+	return len;
+}
+
 /* decompress a section of an open file. Call fatal_return(() on error
    return the number of bytes that have been retrieved
  */
@@ -256,12 +310,14 @@ static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64
 {
 	uint32 good_cksum, cksum = 0;
 	i64 len, ofs, total = 0;
-	int l = -1, p = 0;
+	int l = -1, lm = -1, p = 0;
 	char chunk_bytes;
 	struct stat st;
 	uchar head;
 	void *ss;
 	bool err = false;
+	double start = 0, cpu = 0, other = 0;
+	struct chunk_stats cs;
 
 	/* for display of progress */
 	unsigned long divisor[] = {1,1024,1048576,1073741824U};
@@ -310,6 +366,17 @@ static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64
 	if (unlikely(!ss))
 		failure_return(("Failed to open_stream_in in runzip_chunk\n"), -1);
 
+	memset(&cs, 0, sizeof(cs));
+	if (TIMING)
+		start = stats_time();
+	if (control->stats) {
+		/* All of these are only added to by this thread when
+		 * decompressing so it's safe to read them */
+		other = control->stats->backend_wait + control->stats->io_wall +
+			control->stats->hash_wall;
+		cpu = stats_thread_cpu() - control->stats->hash_cpu;
+	}
+
 	/* All chunks were unnecessarily encoded 8 bytes wide version 0.4x */
 	if (control->major_version == 0 && control->minor_version == 4)
 		control->chunk_bytes = 8;
@@ -328,6 +395,22 @@ static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64
 					return -1;
 				}
 				total += u;
+				cs.literals++;
+				cs.literal_bytes += u;
+				break;
+
+			case 2:
+				if (unlikely(!control->holes)) {
+					print_err("Hole record in an archive not flagged as sparse\n");
+					close_stream_in(control, ss);
+					return -1;
+				}
+				u = unzip_hole(control, ss, &cksum, chunk_bytes);
+				if (unlikely(u == -1)) {
+					close_stream_in(control, ss);
+					return -1;
+				}
+				total += u;
 				break;
 
 			default:
@@ -337,10 +420,16 @@ static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64
 					return -1;
 				}
 				total += u;
+				cs.matches++;
+				cs.match_bytes += u;
 				break;
 		}
 		if (expected_size) {
 			p = 100 * ((double)(tally + total) / (double)expected_size);
+			if (control->metrics && p != lm) {
+				metrics_progress(control, tally + total);
+				lm = p;
+			}
 			if (p / 10 != l / 10)  {
 				prog_done = (double)(tally + total) / (double)divisor[divisor_index];
 				print_progress("%3d%%  %9.2f / %9.2f %s\r",
@@ -363,27 +452,43 @@ static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64
 		print_maxverbose("Checksum for block: 0x%08x\n", cksum);
 	}
 
+	if (control->stats) {
+		/* Leave only the time spent reconstructing the data */
+		cs.rzip_wall = stats_time() - start - (control->stats->backend_wait +
+			control->stats->io_wall + control->stats->hash_wall - other);
+		cs.rzip_cpu = stats_thread_cpu() - control->stats->hash_cpu - cpu;
+		cs.u_len = total;
+		stats_end_chunk(control, ((struct stream_info *)ss)->chunk_no, &cs);
+	}
+	if (control->trace)
+		trace_span(control, TRACE_RZIP, "runzip chunk", start, total);
+	if (control->metrics)
+		metrics_progress(control, tally + total);
+
 	if (unlikely(close_stream_in(control, ss)))
 		fatal("Failed to close stream!\n");
 
 	return total;
 }
 
-/* Decompress an open file. Call fatal_return(() on error
-   return the number of bytes that have been retrieved
- */
-i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
+static i64 runzip_file(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
 {
 	uchar md5_stored[MD5_DIGEST_SIZE];
 	struct timeval start,end;
 	i64 total = 0, u;
 	double tdiff;
+	int chunk = 0;
 
+	init_mutex(control, &control->control_lock);
+	nodes_bind_thread(control, 0);
+	control->sparse_out = false;
 	if (!NO_MD5)
 		md5_init_ctx (&control->ctx);
 	gettimeofday(&start,NULL);
 
 	do {
+		if (control->metrics)
+			metrics_pass(control, ++chunk, 0, expected_size);
 		u = runzip_chunk(control, fd_in, expected_size, total);
 		if (u < 1) {
 			if (u < 0 || total < expected_size) {
@@ -407,6 +512,14 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
 		}
 	} while (total < expected_size || (!expected_size && !control->eof));
 
+	/* A file ending in a hole has only been seeked to its full size */
+	if (control->sparse_out) {
+		i64 end = lseek(control->fd_out, 0, SEEK_CUR);
+
+		if (unlikely(end == -1 || ftruncate(control->fd_out, end)))
+			fatal_return(("Failed to extend %s over its final hole\n", control->outfile), -1);
+	}
+
 	gettimeofday(&end,NULL);
 	if (!ENCRYPT) {
 		tdiff = end.tv_sec - start.tv_sec;
@@ -415,6 +528,13 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
 		print_output("\nAverage DeCompression Speed: %6.3fMB/s\n",
 			       (total / 1024 / 1024) / tdiff);
 	}
+	if (control->stats) {
+		struct stat s;
+
+		if (!fstat(fd_in, &s))
+			control->stats->in_bytes = s.st_size;
+		control->stats->out_bytes = total;
+	}
 
 	if (!NO_MD5) {
 		int i,j;
@@ -486,3 +606,18 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
 
 	return total;
 }
+
+/* Decompress an open file. Call fatal_return(() on error
+   return the number of bytes that have been retrieved
+ */
+i64 runzip_fd(rzip_control *control, int fd_in, int fd_hist, i64 expected_size)
+{
+	i64 total;
+
+	init_stream_threads(control);
+	total = runzip_file(control, fd_in, fd_hist, expected_size);
+	/* Threads of a failed chunk may still be waiting on them */
+	if (total >= 0)
+		fini_stream_threads(control);
+	return total;
+}
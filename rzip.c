@@ -55,6 +55,9 @@
 #include "md5.h"
 #include "stream.h"
 #include "util.h"
+#include "stats.h"
+#include "numa.h"
+#include "throttle.h"
 #include "lrzip_core.h"
 /* needed for CRC routines */
 #include "lzma/C/7zCrc.h"
@@ -66,7 +69,10 @@
 #define CHUNK_MULTIPLE (100 * 1024 * 1024)
 #define CKSUM_CHUNK 1024*1024
 #define GREAT_MATCH 1024
-#define MINIMUM_MATCH 31
+#define THROTTLE_BYTES (1024 * 1024) // Input searched between --read-limit checks
+#define MINIMUM_HOLE (64 * 1024) // Smaller holes are left to be matched as zeros
+#define MINIMUM_RUN 256 // Shorter runs of one byte value are left to the hash search
+#define NEXT_CHUNK_READAHEAD (64 * 1024 * 1024) // Read in while the chunk before is hashed
 
 /* Hash table works as follows.  We start by throwing tags at every
  * offset into the table.  As it fills, we start eliminating tags
@@ -75,30 +81,45 @@
  * that on average, all parts of the file are covered by the hash, if
  * sparsely. */
 
-/* All zero means empty.  We might miss the first chunk this way. */
+/* The top bits of offset hold the generation the entry was stored in, and
+ * entries from any other generation are empty. Starting a new generation for
+ * each chunk then empties the table without writing to it. */
 struct hash_entry {
 	i64 offset;
 	tag t;
 };
 
-/* Levels control hashtable size and bzip2 level. */
+#define HASH_GEN_SHIFT 48
+#define HASH_GEN_MAX ((1 << 15) - 1)
+#define HASH_OFFSET_MASK ((1ll << HASH_GEN_SHIFT) - 1)
+
+/* Levels control hashtable size and bzip2 level, and whether matches are
+ * chosen by what they cost to store rather than just by length. */
 static struct level {
 	unsigned long mb_used;
 	unsigned initial_freq;
 	unsigned max_chain_len;
+	bool lazy;
 } levels[10] = {
-	{ 1, 4, 1 },
-	{ 2, 4, 2 },
-	{ 4, 4, 2 },
-	{ 8, 4, 2 },
-	{ 16, 4, 3 },
-	{ 32, 4, 4 },
-	{ 32, 2, 6 },
-	{ 64, 1, 16 }, /* More MB makes sense, but need bigger test files */
-	{ 64, 1, 32 },
-	{ 64, 1, 128 },
+	{ 1, 4, 1, false },
+	{ 2, 4, 2, false },
+	{ 4, 4, 2, false },
+	{ 8, 4, 2, false },
+	{ 16, 4, 3, false },
+	{ 32, 4, 4, false },
+	{ 32, 2, 6, false },
+	{ 64, 1, 16, false }, /* More MB makes sense, but need bigger test files */
+	{ 64, 1, 32, true },
+	{ 64, 1, 128, true },
 };
 
+/* Tell the kernel how an input mmap will be used. These are only hints so
+ * any failure is ignored. */
+static inline void advise_mmap(void *buf, i64 len, int advice)
+{
+	madvise(buf, len, advice);
+}
+
 static void remap_low_sb(rzip_control *control, struct sliding_buffer *sb)
 {
 	i64 new_offset;
@@ -106,6 +127,11 @@ static void remap_low_sb(rzip_control *control, struct sliding_buffer *sb)
 	new_offset = sb->offset_search;
 	round_to_page(&new_offset);
 	print_maxverbose("Sliding main buffer to offset %lld\n", new_offset);
+#ifdef MADV_COLD
+	/* What was hashed is now only read through the high buffer for
+	 * matches, so let its pages be reclaimed ahead of the stream buffers */
+	advise_mmap(sb->buf_low, sb->size_low, MADV_COLD);
+#endif
 	if (unlikely(munmap(sb->buf_low, sb->size_low)))
 		failure("Failed to munmap in remap_low_sb\n");
 	if (new_offset + sb->size_low > sb->orig_size)
@@ -114,6 +140,7 @@ static void remap_low_sb(rzip_control *control, struct sliding_buffer *sb)
 	sb->buf_low = (uchar *)mmap(sb->buf_low, sb->size_low, PROT_READ, MAP_SHARED, sb->fd, sb->orig_offset + sb->offset_low);
 	if (unlikely(sb->buf_low == MAP_FAILED))
 		failure("Failed to re mmap in remap_low_sb\n");
+	advise_mmap(sb->buf_low, sb->size_low, MADV_SEQUENTIAL);
 }
 
 static inline void remap_high_sb(rzip_control *control, struct sliding_buffer *sb, i64 p)
@@ -129,6 +156,7 @@ static inline void remap_high_sb(rzip_control *control, struct sliding_buffer *s
 	sb->buf_high = (uchar *)mmap(sb->buf_high, sb->size_high, PROT_READ, MAP_SHARED, sb->fd, sb->orig_offset + sb->offset_high);
 	if (unlikely(sb->buf_high == MAP_FAILED))
 		failure("Failed to re mmap in remap_high_sb\n");
+	advise_mmap(sb->buf_high, sb->size_high, MADV_RANDOM);
 }
 
 /* We use a "sliding mmap" to effectively read more than we can fit into the
@@ -243,6 +271,16 @@ static inline void put_match(rzip_control *control, struct rzip_state *st,
 	} while (len);
 }
 
+/* Holes are stored as a header with no length of their own followed by the
+ * length of the hole, as wide as a match offset */
+static void put_hole(rzip_control *control, struct rzip_state *st, i64 len)
+{
+	put_header(control, st->ss, 2, 0);
+	put_vchars(control, st->ss, len, st->chunk_bytes);
+	st->stats.holes++;
+	st->stats.hole_bytes += len;
+}
+
 /* write some data to a stream mmap encoded. Return -1 on failure */
 static inline void write_sbstream(rzip_control *control, void *ss, int stream,
 				 i64 p, i64 len)
@@ -282,10 +320,152 @@ static void put_literal(rzip_control *control, struct rzip_state *st, i64 last,
 	} while (p > last);
 }
 
-/* Could give false positive on offset 0.  Who cares. */
-static inline bool empty_hash(struct hash_entry *he)
+/* Runs of one byte value are stored as a match one byte behind itself, after
+ * a literal of the first byte unless the byte before the run already has the
+ * same value */
+static void put_run(rzip_control *control, struct rzip_state *st, i64 p, i64 end)
+{
+	uchar b = *sliding_get_sb(control, p);
+
+	if (p && *sliding_get_sb(control, p - 1) == b) {
+		if (st->last_match < p)
+			put_literal(control, st, st->last_match, p);
+	} else
+		put_literal(control, st, st->last_match, ++p);
+	put_match(control, st, p, p - 1, end - p);
+	st->last_match = end;
+}
+
+/* What a match is worth to the lazy parse: the literal bytes it saves less
+ * its header and offset */
+static inline i64 match_worth(struct rzip_state *st, i64 len)
+{
+	return len - 3 - st->chunk_bytes;
+}
+
+static inline bool empty_hash(struct rzip_state *st, struct hash_entry *he)
+{
+	return (he->offset >> HASH_GEN_SHIFT) != st->hash_gen;
+}
+
+static inline i64 hash_offset(struct hash_entry *he)
+{
+	return he->offset & HASH_OFFSET_MASK;
+}
+
+static inline void set_hash(struct rzip_state *st, struct hash_entry *he, tag t, i64 offset)
+{
+	he->t = t;
+	he->offset = offset | (st->hash_gen << HASH_GEN_SHIFT);
+}
+
+/* A blocked Bloom filter of the tags in the hash table, small enough to stay
+ * in the L2 cache, so that most lookups of tags that are not in the table
+ * never touch it. Each tag sets two bits in one word, chosen from the top
+ * bits of the tag times a large odd constant since the low bits of tags in
+ * the table are mostly set. Evicted tags are left in, so it is rebuilt from
+ * the table once as many tags have been added as the table can hold. */
+static inline uint64_t filter_hash(tag t)
+{
+	return (uint64_t)t * 0x9E3779B97F4A7C15ull;
+}
+
+static inline uint64_t *filter_word(struct rzip_state *st, uint64_t h)
+{
+	return &st->filter[h >> (64 - st->filter_bits)];
+}
+
+static inline uint64_t filter_mask(struct rzip_state *st, uint64_t h)
+{
+	h >>= 52 - st->filter_bits;
+	return 1ull << (h & 63) | 1ull << ((h >> 6) & 63);
+}
+
+static inline bool filter_test(struct rzip_state *st, tag t)
+{
+	uint64_t h = filter_hash(t), mask = filter_mask(st, h);
+
+	return (*filter_word(st, h) & mask) == mask;
+}
+
+static inline void filter_add(struct rzip_state *st, tag t)
+{
+	uint64_t h = filter_hash(t);
+
+	*filter_word(st, h) |= filter_mask(st, h);
+}
+
+static void filter_rebuild(struct rzip_state *st)
+{
+	struct hash_entry *he;
+	i64 i;
+
+	memset(st->filter, 0, sizeof(*st->filter) << st->filter_bits);
+	for (i = 0; i < (1U << st->hash_bits); i++) {
+		he = &st->hash_table[i];
+		if (!empty_hash(st, he))
+			filter_add(st, he->t);
+	}
+	st->filter_adds = 0;
+}
+
+static inline void filter_insert(struct rzip_state *st, tag t)
 {
-	return !(he->offset | he->t);
+	filter_add(st, t);
+	if (unlikely(++st->filter_adds > st->hash_limit))
+		filter_rebuild(st);
+}
+
+/* Percentage of the filter bits set */
+static double filter_fill(struct rzip_state *st)
+{
+	i64 i, set = 0;
+
+	for (i = 0; i < (1 << st->filter_bits); i++)
+		set += __builtin_popcountll(st->filter[i]);
+	return 100.0 * set / (64ll << st->filter_bits);
+}
+
+/* Size the filter to at most half the L2 cache with 16 bits per entry the
+ * table can hold. Past 2 bits per entry it would pass most lookups anyway so
+ * it is not used. */
+static void alloc_filter(rzip_control *control, struct rzip_state *st)
+{
+	i64 bytes = 256 * 1024, bits = st->hash_limit * 16;
+
+#ifdef _SC_LEVEL2_CACHE_SIZE
+	if (sysconf(_SC_LEVEL2_CACHE_SIZE) > 0)
+		bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+	bits = MIN(bits, bytes / 2 * 8);
+	if (bits < st->hash_limit * 2)
+		return;
+	for (st->filter_bits = 0; (64ll << st->filter_bits) < bits; st->filter_bits++);
+	if ((64ll << st->filter_bits) > bytes / 2 * 8)
+		st->filter_bits--;
+	st->filter = calloc(1 << st->filter_bits, sizeof(*st->filter));
+	st->filter_adds = 0;
+	/* The filter only saves time, so do without it rather than fail */
+	if (unlikely(!st->filter)) {
+		print_maxverbose("Unable to allocate tag filter, probing the hash table directly\n");
+		st->filter_bits = 0;
+		return;
+	}
+	print_maxverbose("Tag filter of %lluKB\n", (sizeof(*st->filter) << st->filter_bits) / 1024);
+}
+
+/* Empty the hash table for a new chunk. Only once the generations run out is
+ * the table actually cleared. */
+static void new_hash_generation(struct rzip_state *st)
+{
+	if (++st->hash_gen > HASH_GEN_MAX) {
+		memset(st->hash_table, 0, sizeof(st->hash_table[0]) << st->hash_bits);
+		st->hash_gen = 1;
+	}
+	if (st->filter) {
+		memset(st->filter, 0, sizeof(*st->filter) << st->filter_bits);
+		st->filter_adds = 0;
+	}
 }
 
 static i64 primary_hash(struct rzip_state *st, tag t)
@@ -308,6 +488,14 @@ static inline bool minimum_bitness(struct rzip_state *st, tag t)
 	return false;
 }
 
+/* How many low bits are set in t, which is the order entries are cleaned */
+static inline int tag_bitness(tag t)
+{
+	int bits = ffsll(~t);
+
+	return bits ? bits - 1 : 64;
+}
+
 /* Is a going to be cleaned before b?  ie. does a have fewer low bits
  * set than b? */
 static inline bool lesser_bitness(tag a, tag b)
@@ -322,13 +510,11 @@ static inline bool lesser_bitness(tag a, tag b)
 static void insert_hash(struct rzip_state *st, tag t, i64 offset)
 {
 	i64 h, victim_h = 0, round = 0;
-	/* If we need to kill one, this will be it. */
-	static i64 victim_round = 0;
 	struct hash_entry *he;
 
 	h = primary_hash(st, t);
 	he = &st->hash_table[h];
-	while (!empty_hash(he)) {
+	while (!empty_hash(st, he)) {
 		/* If this due for cleaning anyway, just replace it:
 		   rehashing might move it behind tag_clean_ptr. */
 		if (minimum_bitness(st, he->t)) {
@@ -341,22 +527,23 @@ static void insert_hash(struct rzip_state *st, tag t, i64 offset)
 		   it, then take its place. */
 		if (lesser_bitness(he->t, t)) {
 			insert_hash(st, he->t,
-				    he->offset);
+				    hash_offset(he));
 			break;
 		}
 
 		/* If we have lots of identical patterns, we end up
 		   with lots of the same hash number.  Discard random. */
 		if (he->t == t) {
-			if (round == victim_round)
+			/* If we need to kill one, this will be it. */
+			if (round == st->victim_round)
 				victim_h = h;
 			if (++round == st->level->max_chain_len) {
 				h = victim_h;
 				he = &st->hash_table[h];
 				st->hash_count--;
-				victim_round++;
-				if (victim_round == st->level->max_chain_len)
-					victim_round = 0;
+				st->victim_round++;
+				if (st->victim_round == st->level->max_chain_len)
+					st->victim_round = 0;
 				break;
 			}
 		}
@@ -366,89 +553,115 @@ static void insert_hash(struct rzip_state *st, tag t, i64 offset)
 		he = &st->hash_table[h];
 	}
 
-	he->t = t;
-	he->offset = offset;
+	if (!empty_hash(st, he))
+		st->bitness_count[tag_bitness(he->t)]--;
+	st->bitness_count[tag_bitness(t)]++;
+	set_hash(st, he, t, offset);
 }
 
 /* Eliminate one hash entry with minimum number of lower bits set.
-   Returns tag requirement for any new entries. */
+   Returns tag requirement for any new entries.
+   The entries are counted by bitness, so the sweep for a mask ends as soon
+   as the last entry of its level goes rather than running on to the end of
+   the table, and a sweep that reaches the end with victims left behind it
+   (moved there by insert_hash) wraps around for them. Finding one victim is
+   still a linear scan, but as the sweep resumes where it stopped each mask
+   costs at most one pass over the table in all, plus any wrap. */
 static inline tag clean_one_from_hash(rzip_control *control, struct rzip_state *st)
 {
+	i64 size = 1U << st->hash_bits, start;
 	struct hash_entry *he;
 	tag better_than_min;
+	int bitness;
 
 again:
+	bitness = tag_bitness(st->minimum_tag_mask);
+	while (!st->bitness_count[bitness] && bitness < 63) {
+		st->minimum_tag_mask = increase_mask(st->minimum_tag_mask);
+		st->tag_clean_ptr = 0;
+		bitness++;
+	}
 	better_than_min = increase_mask(st->minimum_tag_mask);
 	if (!st->tag_clean_ptr)
 		print_maxverbose("Starting sweep for mask %u\n", (unsigned int)st->minimum_tag_mask);
 
-	for (; st->tag_clean_ptr < (1U << st->hash_bits); st->tag_clean_ptr++) {
+	start = st->tag_clean_ptr;
+	do {
 		he = &st->hash_table[st->tag_clean_ptr];
-		if (empty_hash(he))
-			continue;
-		if ((he->t & better_than_min) != better_than_min) {
+		if (!empty_hash(st, he) && (he->t & better_than_min) != better_than_min) {
+			st->bitness_count[tag_bitness(he->t)]--;
 			he->offset = 0;
 			he->t = 0;
 			st->hash_count--;
+			/* With its level gone, only tags above the new
+			 * minimum are worth inserting */
+			if (!st->bitness_count[bitness]) {
+				st->minimum_tag_mask = better_than_min;
+				st->tag_clean_ptr = 0;
+				return increase_mask(better_than_min);
+			}
 			return better_than_min;
 		}
-	}
+		if (++st->tag_clean_ptr == size)
+			st->tag_clean_ptr = 0;
+	} while (st->tag_clean_ptr != start);
 
-	/* We hit the end: everthing in hash satisfies the better mask. */
+	/* Everything in hash satisfies the better mask, the counts notwithstanding */
+	st->bitness_count[bitness] = 0;
 	st->minimum_tag_mask = better_than_min;
 	st->tag_clean_ptr = 0;
 	goto again;
 }
 
-static void single_next_tag(rzip_control *control, struct rzip_state *st, i64 p, tag *t)
+static inline void single_next_tag(rzip_control *control, struct rzip_state *st, i64 p, tag *t, int mm)
 {
 	uchar u;
 
 	u = control->sb.buf_low[p - 1];
 	*t ^= st->hash_index[u];
-	u = control->sb.buf_low[p + MINIMUM_MATCH - 1];
+	u = control->sb.buf_low[p + mm - 1];
 	*t ^= st->hash_index[u];
 }
 
-static void sliding_next_tag(rzip_control *control, struct rzip_state *st, i64 p, tag *t)
+static inline void sliding_next_tag(rzip_control *control, struct rzip_state *st, i64 p, tag *t, int mm)
 {
 	uchar *u;
 
 	u = sliding_get_sb(control, p - 1);
 	*t ^= st->hash_index[*u];
-	u = sliding_get_sb(control, p + MINIMUM_MATCH - 1);
+	u = sliding_get_sb(control, p + mm - 1);
 	*t ^= st->hash_index[*u];
 }
 
-static tag single_full_tag(rzip_control *control, struct rzip_state *st, i64 p)
+static inline tag single_full_tag(rzip_control *control, struct rzip_state *st, i64 p, int mm)
 {
 	tag ret = 0;
 	int i;
 	uchar u;
 
-	for (i = 0; i < MINIMUM_MATCH; i++) {
+	for (i = 0; i < mm; i++) {
 		u = control->sb.buf_low[p + i];
 		ret ^= st->hash_index[u];
 	}
 	return ret;
 }
 
-static tag sliding_full_tag(rzip_control *control, struct rzip_state *st, i64 p)
+static inline tag sliding_full_tag(rzip_control *control, struct rzip_state *st, i64 p, int mm)
 {
 	tag ret = 0;
 	int i;
 	uchar *u;
 
-	for (i = 0; i < MINIMUM_MATCH; i++) {
+	for (i = 0; i < mm; i++) {
 		u = sliding_get_sb(control, p + i);
 		ret ^= st->hash_index[*u];
 	}
 	return ret;
 }
 
-static i64
+static inline i64
 single_match_len(rzip_control *control, struct rzip_state *st, i64 p0, i64 op,
-		 i64 end, i64 *rev)
+		 i64 end, i64 *rev, int mm)
 {
 	i64 p, len;
 
@@ -472,15 +685,15 @@ single_match_len(rzip_control *control, struct rzip_state *st, i64 p0, i64 op,
 	}
 
 	len += *rev = p0 - p;
-	if (len < MINIMUM_MATCH)
+	if (len < mm)
 		return 0;
 
 	return len;
 }
 
-static i64
+static inline i64
 sliding_match_len(rzip_control *control, struct rzip_state *st, i64 p0, i64 op,
-		  i64 end, i64 *rev)
+		  i64 end, i64 *rev, int mm)
 {
 	i64 p, len;
 
@@ -504,15 +717,35 @@ sliding_match_len(rzip_control *control, struct rzip_state *st, i64 p0, i64 op,
 	}
 
 	len += *rev = p0 - p;
-	if (len < MINIMUM_MATCH)
+	if (len < mm)
 		return 0;
 
 	return len;
 }
 
-static inline i64
+/* The search loop is built twice, for a chunk in one mmap and for a sliding
+ * one, with these picking the accessors at compile time so the hot loop has
+ * no indirect calls and the single mmap versions can be inlined */
+static inline __attribute__((always_inline)) void
+search_next_tag(rzip_control *control, struct rzip_state *st, i64 p, tag *t, bool sliding, int mm)
+{
+	if (sliding)
+		sliding_next_tag(control, st, p, t, mm);
+	else
+		single_next_tag(control, st, p, t, mm);
+}
+
+static inline __attribute__((always_inline)) tag
+search_full_tag(rzip_control *control, struct rzip_state *st, i64 p, bool sliding, int mm)
+{
+	if (sliding)
+		return sliding_full_tag(control, st, p, mm);
+	return single_full_tag(control, st, p, mm);
+}
+
+static inline __attribute__((always_inline)) i64
 find_best_match(rzip_control *control, struct rzip_state *st, tag t, i64 p,
-		i64 end, i64 *offset, i64 *reverse)
+		i64 end, i64 *offset, i64 *reverse, bool sliding, int mm)
 {
 	struct hash_entry *he;
 	i64 length = 0;
@@ -526,16 +759,18 @@ find_best_match(rzip_control *control, struct rzip_state *st, tag t, i64 p,
 	 * chains are usually short anyway. */
 	h = primary_hash(st, t);
 	he = &st->hash_table[h];
-	while (!empty_hash(he)) {
+	while (!empty_hash(st, he)) {
 		i64 mlen;
 
 		if (t == he->t) {
-			mlen = control->match_len(control, st, p, he->offset, end,
-						  &rev);
+			if (sliding)
+				mlen = sliding_match_len(control, st, p, hash_offset(he), end, &rev, mm);
+			else
+				mlen = single_match_len(control, st, p, hash_offset(he), end, &rev, mm);
 			if (mlen) {
 				if (mlen > length) {
 					length = mlen;
-					(*offset) = he->offset - rev;
+					(*offset) = hash_offset(he) - rev;
 					(*reverse) = rev;
 				}
 				st->stats.tag_hits++;
@@ -560,7 +795,7 @@ static void show_distrib(rzip_control *control, struct rzip_state *st)
 
 	for (i = 0; i < (1U << st->hash_bits); i++) {
 		he = &st->hash_table[i];
-		if (empty_hash(he))
+		if (empty_hash(st, he))
 			continue;
 		total++;
 		if (primary_hash(st, he->t) == i)
@@ -582,13 +817,24 @@ static void show_distrib(rzip_control *control, struct rzip_state *st)
 static void *cksumthread(void *data)
 {
 	rzip_control *control = (rzip_control *)data;
+	double start = 0, cpu = 0;
 
 	pthread_detach(pthread_self());
 
+	if (TIMING) {
+		start = stats_time();
+		cpu = stats_thread_cpu();
+	}
 	*control->checksum.cksum = CrcUpdate(*control->checksum.cksum, control->checksum.buf, control->checksum.len);
 	if (!NO_MD5)
 		md5_process_bytes(control->checksum.buf, control->checksum.len, &control->ctx);
 	dealloc(control->checksum.buf);
+	if (control->stats) {
+		stats_add(control, &control->stats->hash_wall, stats_time() - start);
+		stats_add(control, &control->stats->hash_cpu, stats_thread_cpu() - cpu);
+	}
+	if (control->trace)
+		trace_span(control, TRACE_CKSUM, "checksum", start, control->checksum.len);
 	cksem_post(control, &control->cksumsem);
 	return NULL;
 }
@@ -600,13 +846,120 @@ static inline void cksum_update(rzip_control *control)
 	create_pthread(control, &thread, NULL, cksumthread, control);
 }
 
-static inline void hash_search(rzip_control *control, struct rzip_state *st,
-			       double pct_base, double pct_multiple)
+/* Bring the checksum up to the end of a hole synchronously, feeding it zeros
+ * for the hole itself instead of faulting in its pages */
+static void cksum_hole(rzip_control *control, struct rzip_state *st, i64 *cksum_limit,
+		       struct hole *hole)
+{
+	static const uchar zeros[65536];
+	uchar *buf;
+	i64 n;
+
+	cksem_wait(control, &control->cksumsem);
+	if (*cksum_limit < hole->start) {
+		buf = malloc(MIN(CKSUM_CHUNK, hole->start - *cksum_limit));
+		if (unlikely(!buf))
+			failure("Failed to malloc ckbuf in cksum_hole\n");
+		while (*cksum_limit < hole->start) {
+			n = MIN(CKSUM_CHUNK, hole->start - *cksum_limit);
+			control->do_mcpy(control, buf, *cksum_limit, n);
+			st->cksum = CrcUpdate(st->cksum, buf, n);
+			if (!NO_MD5)
+				md5_process_bytes(buf, n, &control->ctx);
+			*cksum_limit += n;
+		}
+		dealloc(buf);
+	}
+	while (*cksum_limit < hole->end) {
+		n = MIN((i64)sizeof(zeros), hole->end - *cksum_limit);
+		st->cksum = CrcUpdate(st->cksum, zeros, n);
+		if (!NO_MD5)
+			md5_process_bytes(zeros, n, &control->ctx);
+		*cksum_limit += n;
+	}
+	cksem_post(control, &control->cksumsem);
+}
+
+static bool alloc_hash_table(rzip_control *control, struct rzip_state *st)
+{
+	i64 hashsize = st->level->mb_used *
+			(1024 * 1024 / sizeof(st->hash_table[0]));
+
+	/* There can never be more entries than bytes of input, and every chunk
+	 * is no larger than the file, so don't zero more table than that */
+	if (!STDIN && control->st_size)
+		hashsize = MIN(hashsize, control->st_size);
+	for (st->hash_bits = 0; (1U << st->hash_bits) < hashsize; st->hash_bits++);
+
+	print_maxverbose("hashsize = %lld.  bits = %lld. %lluKB\n",
+			 hashsize, st->hash_bits, (sizeof(st->hash_table[0]) << st->hash_bits) / 1024);
+
+	/* 66% full at max. */
+	st->hash_limit = (1 << st->hash_bits) / 3 * 2;
+	st->hash_table = calloc(sizeof(st->hash_table[0]), (1 << st->hash_bits));
+	st->hash_gen = 1;
+	if (st->hash_table)
+		alloc_filter(control, st);
+	return st->hash_table != NULL;
+}
+
+/* Find the run of one byte value that p is in, going back no further than the
+ * last match and returning where it ends before end. It is scanned a word at
+ * a time through whichever part of the sliding buffer holds it. */
+static i64 find_run(rzip_control *control, struct rzip_state *st, i64 p, i64 end,
+		    i64 *start)
+{
+	uchar b = *sliding_get_sb(control, p);
+	uint64_t pattern = 0x0101010101010101ULL * b, word;
+	i64 i, n;
+
+	for (*start = p; *start > st->last_match; (*start)--) {
+		if (*sliding_get_sb(control, *start - 1) != b)
+			break;
+	}
+	while (p < end) {
+		uchar *buf = sliding_get_sb(control, p);
+
+		n = MIN(sliding_get_sb_range(control, p), end - p);
+		for (i = 0; i + 8 <= n; i += 8) {
+			memcpy(&word, buf + i, 8);
+			if (word != pattern)
+				break;
+		}
+		while (i < n && buf[i] == b)
+			i++;
+		p += i;
+		if (i < n)
+			break;
+	}
+	return p;
+}
+
+/* A match at least twice the default length still spans as many sampled
+ * offsets when only half as many are hashed, so start with a sparser mask */
+static inline tag initial_tag_mask(struct rzip_state *st, int mm)
+{
+	unsigned freq = st->level->initial_freq;
+
+	if (mm >= 2 * MINIMUM_MATCH)
+		freq++;
+	return (1 << freq) - 1;
+}
+
+static inline __attribute__((always_inline)) void
+hash_search(rzip_control *control, struct rzip_state *st, double pct_base,
+	    double pct_multiple, bool sliding, int mm)
 {
 	i64 cksum_limit = 0, p, end, cksum_chunks, cksum_remains, i;
-	tag t = 0, tag_mask = (1 << st->level->initial_freq) - 1;
+	double start = 0, cpu = 0;
+	tag t = 0, last_tag = 0, tag_mask = initial_tag_mask(st, mm);
 	struct sliding_buffer *sb = &control->sb;
-	int lastpct = 0, last_chunkpct = 0;
+	struct hole *hole = st->holes, *last_hole = st->holes + st->nholes;
+	int lastpct = 0, last_chunkpct = 0, same_tags = 0;
+	i64 search_end, throttled = 0;
+	/* The lazy parse looks further ahead for a better match */
+	i64 lookahead = st->level->lazy ? 2 * mm : mm;
+	double cpu_mark = 0;
 	struct {
 		i64 p;
 		i64 ofs;
@@ -614,40 +967,55 @@ static inline void hash_search(rzip_control *control, struct rzip_state *st,
 	} current;
 
 	if (st->hash_table)
-		memset(st->hash_table, 0, sizeof(st->hash_table[0]) * (1<<st->hash_bits));
-	else {
-		i64 hashsize = st->level->mb_used *
-				(1024 * 1024 / sizeof(st->hash_table[0]));
-		for (st->hash_bits = 0; (1U << st->hash_bits) < hashsize; st->hash_bits++);
-
-		print_maxverbose("hashsize = %lld.  bits = %lld. %luMB\n",
-				 hashsize, st->hash_bits, st->level->mb_used);
-
-		/* 66% full at max. */
-		st->hash_limit = (1 << st->hash_bits) / 3 * 2;
-		st->hash_table = calloc(sizeof(st->hash_table[0]), (1 << st->hash_bits));
-		if (unlikely(!st->hash_table))
-			failure("Failed to allocate hash table in hash_search\n");
-	}
+		new_hash_generation(st);
+	else if (unlikely(!alloc_hash_table(control, st)))
+		failure("Failed to allocate hash table in hash_search\n");
 
 	st->minimum_tag_mask = tag_mask;
 	st->tag_clean_ptr = 0;
 	st->cksum = 0;
 	st->hash_count = 0;
+	memset(st->bitness_count, 0, sizeof(st->bitness_count));
 
 	p = 0;
-	end = st->chunk_size - MINIMUM_MATCH;
+	end = st->chunk_size - mm;
 	st->last_match = p;
 	current.len = 0;
 	current.p = p;
 	current.ofs = 0;
+	/* Matches must stop short of the next hole so it is never read */
+	search_end = hole < last_hole ? MIN(end, hole->start) : end;
 
 	if (likely(end > 0))
-		t = control->full_tag(control, st, p);
+		t = search_full_tag(control, st, p, sliding, mm);
+	if (control->cpu_limit)
+		cpu_mark = stats_thread_cpu();
 
 	while (p < end) {
 		i64 reverse, mlen, offset;
 
+		if (unlikely(hole < last_hole && p + mm >= hole->start)) {
+			if (current.len >= mm) {
+				if (st->last_match < current.p)
+					put_literal(control, st, st->last_match, current.p);
+				put_match(control, st, current.p, current.ofs, current.len);
+				st->last_match = current.p + current.len;
+			}
+			if (st->last_match < hole->start)
+				put_literal(control, st, st->last_match, hole->start);
+			put_hole(control, st, hole->end - hole->start);
+			cksum_hole(control, st, &cksum_limit, hole);
+			throttled += hole->end - hole->start;
+			st->last_match = hole->end;
+			current.p = p = st->last_match;
+			current.len = 0;
+			hole++;
+			search_end = hole < last_hole ? MIN(end, hole->start) : end;
+			if (p >= end)
+				break;
+			t = search_full_tag(control, st, p, sliding, mm);
+		}
+
 		sb->offset_search = ++p;
 		if (unlikely(sb->offset_search > sb->offset_low + sb->size_low))
 			remap_low_sb(control, &control->sb);
@@ -665,12 +1033,57 @@ static inline void hash_search(rzip_control *control, struct rzip_state *st,
 				if (control->info_cb)
 					control->info_cb(control->info_data,
 						(!STDIN || st->stdin_eof) ? pct : -1, chunk_pct);
+				if (control->metrics)
+					metrics_progress(control, sb->orig_offset + p);
 				lastpct = pct;
 				last_chunkpct = chunk_pct;
 			}
+			/* The input is read through the mmap as it is searched so
+			 * limit its bandwidth and our CPU time here */
+			if (unlikely((control->throttle || control->cpu_limit) &&
+				     p - throttled >= THROTTLE_BYTES)) {
+				double cpu_now = control->cpu_limit ? stats_thread_cpu() : 0;
+
+				throttle_cpu(control, cpu_now - cpu_mark);
+				throttle_read(control, p - throttled);
+				throttled = p;
+				cpu_mark = cpu_now;
+			}
 		}
 
-		control->next_tag(control, st, p, &t);
+		search_next_tag(control, st, p, &t, sliding, mm);
+
+		/* The tag is left unchanged when the byte entering the window is
+		 * the one leaving it, as all through a run of one byte value, so
+		 * look for a run once that has held for a whole window. Runs are
+		 * stored as one match with no tag work or hash inserts. */
+		if (t != last_tag) {
+			last_tag = t;
+			same_tags = 0;
+		} else if (unlikely(++same_tags == mm)) {
+			i64 run, run_end, pending = 0;
+
+			same_tags = 0;
+			run_end = find_run(control, st, p, search_end, &run);
+			if (current.len >= mm)
+				pending = current.p + current.len;
+			run = MAX(run, pending);
+			if (run_end - run >= MINIMUM_RUN) {
+				if (pending) {
+					if (st->last_match < current.p)
+						put_literal(control, st, st->last_match, current.p);
+					put_match(control, st, current.p, current.ofs, current.len);
+					st->last_match = pending;
+				}
+				put_run(control, st, run, run_end);
+				current.p = p = st->last_match;
+				current.len = 0;
+				if (p >= end)
+					break;
+				last_tag = t = search_full_tag(control, st, p, sliding, mm);
+				continue;
+			}
+		}
 
 		/* Don't look for a match if there are no tags with
 		   this number of bits in the hash table. */
@@ -678,35 +1091,67 @@ static inline void hash_search(rzip_control *control, struct rzip_state *st,
 			continue;
 
 		offset = 0;
-		mlen = find_best_match(control, st, t, p, end, &offset, &reverse);
+		if (st->filter && !filter_test(st, t)) {
+			st->stats.filter_skips++;
+			mlen = reverse = 0;
+		} else {
+			i64 probes = st->stats.tag_hits + st->stats.tag_misses;
+
+			mlen = find_best_match(control, st, t, p, search_end, &offset, &reverse, sliding, mm);
+			if (st->filter && probes == st->stats.tag_hits + st->stats.tag_misses)
+				st->stats.filter_false++;
+		}
 
 		/* Only insert occasionally into hash. */
 		if ((t & tag_mask) == tag_mask) {
 			st->stats.inserts++;
 			st->hash_count++;
 			insert_hash(st, t, p);
+			if (st->filter)
+				filter_insert(st, t);
 			if (st->hash_count > st->hash_limit)
 				tag_mask = clean_one_from_hash(control, st);
 		}
 
-		if (mlen > current.len) {
+		if (st->level->lazy && current.len && mlen) {
+			/* Weigh keeping the current match, taking the new one
+			 * instead, or cutting the current one short where the
+			 * new one starts and storing both */
+			i64 np = p - reverse, cut = MIN(np - current.p, current.len);
+			i64 keep = match_worth(st, current.len), swap = match_worth(st, mlen);
+			i64 both = cut >= mm ? match_worth(st, cut) + swap : keep;
+
+			if (both > keep && both > swap) {
+				if (st->last_match < current.p)
+					put_literal(control, st, st->last_match, current.p);
+				put_match(control, st, current.p, current.ofs, cut);
+				st->last_match = current.p + cut;
+			}
+			if (both > keep || swap > keep) {
+				current.p = np;
+				current.len = mlen;
+				current.ofs = offset;
+			}
+		} else if (mlen > current.len) {
 			current.p = p - reverse;
 			current.len = mlen;
 			current.ofs = offset;
 		}
 
-		if ((current.len >= GREAT_MATCH || p >= current.p + MINIMUM_MATCH)
-		    && current.len >= MINIMUM_MATCH) {
+		if ((current.len >= GREAT_MATCH || p >= current.p + lookahead)
+		    && current.len >= mm) {
 			if (st->last_match < current.p)
 				put_literal(control, st, st->last_match, current.p);
 			put_match(control, st, current.p, current.ofs, current.len);
 			st->last_match = current.p + current.len;
 			current.p = p = st->last_match;
 			current.len = 0;
-			t = control->full_tag(control, st, p);
+			t = search_full_tag(control, st, p, sliding, mm);
 		}
 
-		if (p > cksum_limit) {
+		/* Small inputs are checksummed in one go at the end rather
+		 * than starting a thread for every page */
+		if (p > cksum_limit && !control->small_input) {
 			/* We lock the mutex here and unlock it in the
 			 * cksumthread. This lock protects all the data in
 			 * control->checksum.
@@ -730,7 +1175,7 @@ static inline void hash_search(rzip_control *control, struct rzip_state *st,
 		put_literal(control, st, st->last_match, st->chunk_size);
 
 	if (st->chunk_size > cksum_limit) {
-		i64 cksum_len = control->maxram;
+		i64 cksum_len = MIN(control->maxram, st->chunk_size - cksum_limit);
 		void *buf;
 
 		while (42) {
@@ -748,6 +1193,10 @@ static inline void hash_search(rzip_control *control, struct rzip_state *st,
 		/* Compute checksum. If the entire chunk is longer than maxram,
 		 * do it "per-partes" */
 		cksem_wait(control, &control->cksumsem);
+		if (TIMING) {
+			start = stats_time();
+			cpu = stats_thread_cpu();
+		}
 		control->checksum.buf = buf;
 		control->checksum.len = st->chunk_size - cksum_limit;
 		cksum_chunks = control->checksum.len / cksum_len;
@@ -766,6 +1215,12 @@ static inline void hash_search(rzip_control *control, struct rzip_state *st,
 		if (!NO_MD5)
 			md5_process_bytes(control->checksum.buf, cksum_remains, &control->ctx);
 		dealloc(control->checksum.buf);
+		if (control->stats) {
+			stats_add(control, &control->stats->hash_wall, stats_time() - start);
+			stats_add(control, &control->stats->hash_cpu, stats_thread_cpu() - cpu);
+		}
+		if (control->trace)
+			trace_span(control, TRACE_RZIP, "checksum", start, control->checksum.len);
 		cksem_post(control, &control->cksumsem);
 	} else {
 		cksem_wait(control, &control->cksumsem);
@@ -777,6 +1232,35 @@ static inline void hash_search(rzip_control *control, struct rzip_state *st,
 }
 
 
+/* Build the search loop for each mmap layout at the commonly used minimum
+ * match lengths so the tag window is a constant there. A longer minimum means
+ * far fewer inserts and probes, a shorter one finds more matches in text. */
+#define HASH_SEARCH_MM(mm) do { \
+	if (sliding) \
+		hash_search(control, st, pct_base, pct_multiple, true, mm); \
+	else \
+		hash_search(control, st, pct_base, pct_multiple, false, mm); \
+} while (0)
+
+static void hash_search_mm(rzip_control *control, struct rzip_state *st,
+			   double pct_base, double pct_multiple, bool sliding)
+{
+	switch (control->min_match) {
+	case 16:
+		HASH_SEARCH_MM(16);
+		break;
+	case MINIMUM_MATCH:
+		HASH_SEARCH_MM(MINIMUM_MATCH);
+		break;
+	case 64:
+		HASH_SEARCH_MM(64);
+		break;
+	default:
+		HASH_SEARCH_MM(control->min_match);
+		break;
+	}
+}
+
 static inline void init_hash_indexes(struct rzip_state *st)
 {
 	int i;
@@ -862,6 +1346,9 @@ init_sliding_mmap(rzip_control *control, struct rzip_state *st, int fd_in,
 		sb->buf_high = (uchar *)mmap(NULL, sb->high_length, PROT_READ, MAP_SHARED, fd_in, offset);
 		if (unlikely(sb->buf_high == MAP_FAILED))
 			failure("Unable to mmap buf_high in init_sliding_mmap\n");
+		/* The high buffer jumps about the file and readahead only
+		 * pulls in pages it won't use */
+		advise_mmap(sb->buf_high, sb->high_length, MADV_RANDOM);
 		sb->size_high = sb->high_length;
 		sb->offset_high = 0;
 	}
@@ -872,6 +1359,81 @@ init_sliding_mmap(rzip_control *control, struct rzip_state *st, int fd_in,
 	sb->fd = fd_in;
 }
 
+/* Find the holes in this chunk of a sparse file so that hash_search can skip
+ * them without reading them. Filesystems without hole support report the
+ * whole file as data. */
+static void find_holes(rzip_control *control, struct rzip_state *st, int fd_in,
+		       i64 offset)
+{
+	i64 pos = offset, end = offset + st->chunk_size;
+#ifdef SEEK_HOLE
+	i64 cur = lseek(fd_in, 0, SEEK_CUR);
+#endif
+
+	st->nholes = 0;
+#ifdef SEEK_HOLE
+	while (pos < end) {
+		i64 start = lseek(fd_in, pos, SEEK_HOLE);
+		i64 data;
+
+		if (start == -1 || start >= end)
+			break;
+		data = lseek(fd_in, start, SEEK_DATA);
+		/* No more data means the hole runs to the end of the file */
+		if (data == -1 || data > end)
+			data = end;
+		/* Every chunk needs a literal for the reader to find its way
+		 * past the literal stream, so keep the first byte out of it */
+		if (start == offset)
+			start++;
+		if (data - start >= MINIMUM_HOLE) {
+			st->holes = realloc(st->holes, sizeof(struct hole) * (st->nholes + 1));
+			if (unlikely(!st->holes))
+				failure("Failed to realloc holes in find_holes\n");
+			st->holes[st->nholes].start = start - offset;
+			st->holes[st->nholes].end = data - offset;
+			st->nholes++;
+		}
+		pos = data;
+	}
+	/* Leave the file where it was for anything reading it after us */
+	if (cur != -1)
+		lseek(fd_in, cur, SEEK_SET);
+	if (st->nholes)
+		print_maxverbose("Found %d holes in chunk\n", st->nholes);
+#endif
+}
+
+/* Whether the file has any hole big enough to be stored as a record */
+static bool sparse_input(int fd_in, i64 len)
+{
+#ifdef SEEK_HOLE
+	i64 pos = 0, cur = lseek(fd_in, 0, SEEK_CUR);
+	bool ret = false;
+
+	while (pos < len) {
+		i64 start = lseek(fd_in, pos, SEEK_HOLE);
+		i64 data;
+
+		if (start == -1 || start >= len)
+			break;
+		data = lseek(fd_in, start, SEEK_DATA);
+		if (data == -1 || data > len)
+			data = len;
+		if (data - start >= MINIMUM_HOLE) {
+			ret = true;
+			break;
+		}
+		pos = data;
+	}
+	if (cur != -1)
+		lseek(fd_in, cur, SEEK_SET);
+	return ret;
+#else
+	return false;
+#endif
+}
+
 static void add_to_sslist(rzip_control *control, struct rzip_state *st)
 {
 	struct node *node = calloc(sizeof(struct node), 1);
@@ -890,15 +1452,44 @@ rzip_chunk(rzip_control *control, struct rzip_state *st, int fd_in, int fd_out,
 	   i64 offset, double pct_base, double pct_multiple)
 {
 	struct sliding_buffer *sb = &control->sb;
+	double start = 0, cpu = 0, waited = 0;
+	struct chunk_stats cs;
 
 	init_sliding_mmap(control, st, fd_in, offset);
+	if (control->holes)
+		find_holes(control, st, fd_in, offset);
 
 	st->ss = open_stream_out(control, fd_out, NUM_STREAMS, st->chunk_size, st->chunk_bytes);
 	if (unlikely(!st->ss))
 		failure("Failed to open streams in rzip_chunk\n");
 
 	print_verbose("Beginning rzip pre-processing phase\n");
-	hash_search(control, st, pct_base, pct_multiple);
+	if (TIMING)
+		start = stats_time();
+	if (control->stats) {
+		/* Only this thread adds to backend_wait so it's safe to read */
+		waited = control->stats->backend_wait;
+		cpu = stats_thread_cpu();
+		memset(&cs, 0, sizeof(cs));
+		cs.matches = st->stats.matches;
+		cs.match_bytes = st->stats.match_bytes;
+		cs.literals = st->stats.literals;
+		cs.literal_bytes = st->stats.literal_bytes;
+	}
+	hash_search_mm(control, st, pct_base, pct_multiple, st->mmap_size < st->chunk_size);
+	if (control->stats) {
+		/* Time spent blocked on the backend is accounted separately */
+		cs.rzip_wall = stats_time() - start - (control->stats->backend_wait - waited);
+		cs.rzip_cpu = stats_thread_cpu() - cpu;
+		cs.u_len = st->chunk_size;
+		cs.matches = st->stats.matches - cs.matches;
+		cs.match_bytes = st->stats.match_bytes - cs.match_bytes;
+		cs.literals = st->stats.literals - cs.literals;
+		cs.literal_bytes = st->stats.literal_bytes - cs.literal_bytes;
+		stats_end_chunk(control, ((struct stream_info *)st->ss)->chunk_no, &cs);
+	}
+	if (control->trace)
+		trace_span(control, TRACE_RZIP, "rzip chunk", start, st->chunk_size);
 
 	/* unmap buffer before closing and reallocating streams */
 	if (unlikely(munmap(sb->buf_low, sb->size_low))) {
@@ -954,6 +1545,10 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 	i64 free_space;
 
 	init_mutex(control, &control->control_lock);
+	init_stream_threads(control);
+	/* Keep this thread and what it allocates, notably the hash table
+	 * and stream buffers, on the first node */
+	nodes_bind_thread(control, 0);
 	if (!NO_MD5)
 		md5_init_ctx(&control->ctx);
 	cksem_init(control, &control->cksumsem);
@@ -980,6 +1575,12 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 		print_verbose("File size: %lld\n", len);
 	} else
 		control->st_size = 0;
+	/* The header goes out before the chunks when streaming to STDOUT so
+	 * whether hole records may follow has to be settled up front */
+	control->holes = !STDIN && sparse_input(fd_in, len);
+	control->small_input = !STDIN && control->st_size < SMALL_INPUT;
+	if (control->small_input)
+		print_maxverbose("Small input, compressing inline without threads\n");
 
 	if (!STDOUT) {
 		/* Check if there's enough free space on the device chosen to fit the
@@ -1042,9 +1643,6 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 
 	prepare_streamout_threads(control);
 	control->do_mcpy = single_mcpy;
-	control->next_tag = &single_next_tag;
-	control->full_tag = &single_full_tag;
-	control->match_len = &single_match_len;
 
 	while (!pass || len > 0 || (STDIN && !st->stdin_eof)) {
 		double pct_base, pct_multiple;
@@ -1105,12 +1703,11 @@ retry:
 				}
 				goto retry;
 			}
+			/* It is hashed from front to back */
+			advise_mmap(sb->buf_low, st->mmap_size, MADV_SEQUENTIAL);
 			if (st->mmap_size < st->chunk_size) {
 				print_maxverbose("Enabling sliding mmap mode and using mmap of %lld bytes with window of %lld bytes\n", st->mmap_size, st->chunk_size);
 				control->do_mcpy = &sliding_mcpy;
-				control->next_tag = &sliding_next_tag;
-				control->full_tag = &sliding_full_tag;
-				control->match_len = &sliding_match_len;
 			}
 		}
 		print_maxverbose("Succeeded in testing %lld sized mmap for rzip pre-processing\n", st->mmap_size);
@@ -1149,6 +1746,8 @@ retry:
 		pass++;
 		if (st->stdin_eof)
 			passes = pass;
+		if (control->metrics)
+			metrics_pass(control, pass, passes, control->st_size);
 
 		gettimeofday(&current, NULL);
 		/* this will count only when size > window */
@@ -1180,11 +1779,20 @@ retry:
 
 		if (st->chunk_size == len)
 			control->eof = 1;
+#ifdef POSIX_FADV_WILLNEED
+		/* Have the start of the next chunk read in while this one is
+		 * hashed, after which readahead of the mmap keeps up */
+		else if (!STDIN)
+			posix_fadvise(fd_in, offset + st->chunk_size,
+				      MIN(len - st->chunk_size, NEXT_CHUNK_READAHEAD), POSIX_FADV_WILLNEED);
+#endif
 		rzip_chunk(control, st, fd_in, fd_out, offset, pct_base, pct_multiple);
 
 		/* st->chunk_size may be shrunk in rzip_chunk */
 		last_chunk = st->chunk_size;
 		len -= st->chunk_size;
+		if (control->metrics)
+			metrics_progress(control, offset + st->chunk_size);
 		if (unlikely(len > 0 && control->eof)) {
 			close_streamout_threads(control);
 			dealloc(st->hash_table);
@@ -1193,8 +1801,13 @@ retry:
 		}
 	}
 
+	if (st->filter)
+		print_maxverbose("filter_skips=%lld filter_false_positives=%lld filter_fill=%.1f%%\n",
+				 st->stats.filter_skips, st->stats.filter_false, filter_fill(st));
 	if (likely(st->hash_table))
 		dealloc(st->hash_table);
+	dealloc(st->filter);
+	dealloc(st->holes);
 	if (unlikely(!close_streamout_threads(control))) {
 		dealloc(st);
 		failure("Failed to close_streamout_threads in rzip_fd\n");
@@ -1242,15 +1855,230 @@ retry:
 	       (unsigned int)st->stats.literals, (unsigned int)st->stats.literal_bytes);
 	print_maxverbose("true_tag_positives=%u false_tag_positives=%u\n",
 	       (unsigned int)st->stats.tag_hits, (unsigned int)st->stats.tag_misses);
+	if (st->stats.holes)
+		print_maxverbose("holes=%u hole_bytes=%lld\n",
+		       (unsigned int)st->stats.holes, st->stats.hole_bytes);
 	print_maxverbose("inserts=%u match %.3f\n",
 	       (unsigned int)st->stats.inserts,
 	       (1.0 + st->stats.match_bytes) / st->stats.literal_bytes);
 
+	if (control->stats) {
+		control->stats->in_bytes = s.st_size;
+		/* Stdout output has been counted as it was flushed */
+		if (!STDOUT)
+			control->stats->out_bytes = s2.st_size;
+		control->stats->tag_hits = st->stats.tag_hits;
+		control->stats->tag_misses = st->stats.tag_misses;
+		control->stats->filter_skips = st->stats.filter_skips;
+		control->stats->filter_false = st->stats.filter_false;
+		control->stats->inserts = st->stats.inserts;
+	}
+
 	if (!STDIN)
 		print_output("%s - ", control->infile);
 	print_output("Compression Ratio: %.3f. Average Compression Speed: %6.3fMB/s.\n",
 		       1.0 * s.st_size / s2.st_size, chunkmbs);
 
+	fini_stream_threads(control);
 	clear_sslist(st);
 	dealloc(st);
 }
+
+/* Set up a state for running the hash search kernels over an in memory
+ * sample buffer outside of any compression job, for --estimate and the
+ * microbenchmarks. */
+struct rzip_state *sample_rzip_state(rzip_control *control, uchar *buf, i64 len, int level)
+{
+	struct sliding_buffer *sb = &control->sb;
+	struct rzip_state *st;
+
+	st = calloc(sizeof(*st), 1);
+	if (unlikely(!st))
+		fatal_return(("Failed to calloc rzip_state in sample_rzip_state\n"), NULL);
+	st->level = &levels[level];
+	st->chunk_size = st->mmap_size = len;
+	init_hash_indexes(st);
+	if (unlikely(!alloc_hash_table(control, st))) {
+		dealloc(st);
+		fatal_return(("Failed to allocate hash table in sample_rzip_state\n"), NULL);
+	}
+	st->minimum_tag_mask = (1 << st->level->initial_freq) - 1;
+
+	memset(sb, 0, sizeof(*sb));
+	sb->buf_low = buf;
+	sb->size_low = sb->orig_size = len;
+	control->do_mcpy = single_mcpy;
+	return st;
+}
+
+void bench_clear_hash(struct rzip_state *st)
+{
+	new_hash_generation(st);
+	st->hash_count = 0;
+	memset(st->bitness_count, 0, sizeof(st->bitness_count));
+	st->victim_round = 0;
+}
+
+void free_sample_rzip_state(struct rzip_state *st)
+{
+	dealloc(st->hash_table);
+	dealloc(st->filter);
+	dealloc(st);
+}
+
+tag bench_full_tag(rzip_control *control, struct rzip_state *st, i64 p)
+{
+	return single_full_tag(control, st, p, MINIMUM_MATCH);
+}
+
+void bench_next_tag(rzip_control *control, struct rzip_state *st, i64 p, tag *t)
+{
+	single_next_tag(control, st, p, t, MINIMUM_MATCH);
+}
+
+void bench_insert_hash(struct rzip_state *st, tag t, i64 offset)
+{
+	insert_hash(st, t, offset);
+}
+
+i64 bench_find_best_match(rzip_control *control, struct rzip_state *st, tag t, i64 p,
+			  i64 end, i64 *offset, i64 *reverse)
+{
+	return find_best_match(control, st, t, p, end, offset, reverse, false, MINIMUM_MATCH);
+}
+
+i64 bench_single_match_len(rzip_control *control, struct rzip_state *st, i64 p0, i64 op,
+			   i64 end, i64 *rev)
+{
+	return single_match_len(control, st, p0, op, end, rev, MINIMUM_MATCH);
+}
+
+/* Time the search loop at the heart of hash_search, along with the
+ * checksums, over a sample buffer at the current level for --estimate.
+ * Returns the seconds taken per byte. */
+double rzip_sample_speed(rzip_control *control, uchar *buf, i64 len)
+{
+	i64 p, end = len - control->min_match, mlen, offset, reverse;
+	struct rzip_state *st;
+	struct md5_ctx ctx;
+	double start;
+	tag t, tag_mask;
+
+	if (end < 1)
+		return 0;
+	st = sample_rzip_state(control, buf, len, control->compression_level);
+	if (unlikely(!st))
+		return 0;
+	tag_mask = initial_tag_mask(st, control->min_match);
+	start = stats_time();
+	t = single_full_tag(control, st, 0, control->min_match);
+	for (p = 1; p < end; p++) {
+		single_next_tag(control, st, p, &t, control->min_match);
+		if ((t & st->minimum_tag_mask) != st->minimum_tag_mask)
+			continue;
+		mlen = find_best_match(control, st, t, p, end, &offset, &reverse, false, control->min_match);
+		if ((t & tag_mask) == tag_mask) {
+			st->hash_count++;
+			insert_hash(st, t, p);
+			if (st->hash_count > st->hash_limit)
+				tag_mask = clean_one_from_hash(control, st);
+		}
+		/* Skip over matches as hash_search does */
+		if (mlen >= control->min_match) {
+			p += mlen - reverse - 1;
+			if (p >= end)
+				break;
+			t = single_full_tag(control, st, p, control->min_match);
+		}
+	}
+	st->cksum = CrcUpdate(0, buf, len);
+	md5_init_ctx(&ctx);
+	md5_process_bytes(buf, len, &ctx);
+	start = stats_time() - start;
+	free_sample_rzip_state(st);
+	return start / len;
+}
+
+/* Estimate how much of a file rzip would find as long range matches, for
+ * --estimate. Tags are rolled over every byte as in hash_search, but only at
+ * content defined sample points, where the low bits of the tag are all set,
+ * are they hashed and looked up, so a small table can cover a large file and
+ * repeated data is sampled at the same points in every copy. Matches are
+ * extended in both directions and counted for each window that would hold
+ * both ends within the one chunk. Pages wholly inside a match in the first
+ * window are marked in map, one bit per ESTIMATE_PAGE bytes, so what remains
+ * for the backend can be sampled. Returns the sampling interval in bits. */
+int rzip_estimate_matches(rzip_control *control, uchar *buf, i64 len, int nwindows,
+			  const i64 *windows, i64 *matched, i64 *matches, uchar *map)
+{
+	struct hash_entry *table, *he;
+	i64 p, end = len - control->min_match, last_match = 0, entries;
+	int table_bits = 12, sample_bits = 4, lastpct = -1, w;
+	struct rzip_state st;
+	tag t, sample_mask;
+
+	for (w = 0; w < nwindows; w++)
+		matched[w] = matches[w] = 0;
+	if (end < 1)
+		return sample_bits;
+
+	/* Up to 4M entries, with enough sample points to fill half of them */
+	while (table_bits < 22 && (1ll << table_bits) < len / 16)
+		table_bits++;
+	entries = 1ll << table_bits;
+	while ((len >> sample_bits) > entries / 2)
+		sample_bits++;
+	sample_mask = (1 << sample_bits) - 1;
+	print_maxverbose("Estimating matches with %lld entries sampling every %d bytes\n",
+			 entries, 1 << sample_bits);
+	table = calloc(sizeof(*table), entries);
+	if (unlikely(!table))
+		fatal_return(("Failed to calloc hash table in rzip_estimate_matches\n"), -1);
+	init_hash_indexes(&st);
+	st.hash_gen = 1;
+	control->sb.buf_low = buf;
+
+	t = single_full_tag(control, &st, 0, control->min_match);
+	for (p = 1; p < end; p++) {
+		i64 fwd, rev, op, pg;
+
+		single_next_tag(control, &st, p, &t, control->min_match);
+		if ((t & sample_mask) != sample_mask)
+			continue;
+		if (unlikely(p * 100 / end != lastpct)) {
+			lastpct = p * 100 / end;
+			print_progress("Estimating: %2d%%\r", lastpct);
+		}
+		he = &table[(t >> sample_bits) & (entries - 1)];
+		op = hash_offset(he);
+		if (he->t != t || empty_hash(&st, he)) {
+			set_hash(&st, he, t, p);
+			continue;
+		}
+		set_hash(&st, he, t, p);
+
+		for (fwd = 0; p + fwd < len && buf[p + fwd] == buf[op + fwd]; fwd++);
+		for (rev = 0; p - rev > last_match && op - rev > 0 &&
+		     buf[p - rev - 1] == buf[op - rev - 1]; rev++);
+		if (!fwd || fwd + rev < control->min_match)
+			continue;
+		for (w = 0; w < nwindows; w++) {
+			if ((p - rev) / windows[w] == (op - rev) / windows[w]) {
+				matched[w] += fwd + rev;
+				matches[w]++;
+				if (w)
+					continue;
+				for (pg = (p - rev + ESTIMATE_PAGE - 1) / ESTIMATE_PAGE;
+				     pg < (p + fwd) / ESTIMATE_PAGE; pg++)
+					map[pg / 8] |= 1 << (pg % 8);
+			}
+		}
+		last_match = p + fwd;
+		p = last_match - 1;
+		if (last_match >= end)
+			break;
+		t = single_full_tag(control, &st, p, control->min_match);
+	}
+	dealloc(table);
+	return sample_bits;
+}
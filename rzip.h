@@ -22,5 +22,18 @@
 #include "lrzip_private.h"
 
 void rzip_fd(rzip_control *control, int fd_in, int fd_out);
+struct rzip_state *sample_rzip_state(rzip_control *control, uchar *buf, i64 len, int level);
+void bench_clear_hash(struct rzip_state *st);
+void free_sample_rzip_state(struct rzip_state *st);
+tag bench_full_tag(rzip_control *control, struct rzip_state *st, i64 p);
+void bench_next_tag(rzip_control *control, struct rzip_state *st, i64 p, tag *t);
+void bench_insert_hash(struct rzip_state *st, tag t, i64 offset);
+i64 bench_find_best_match(rzip_control *control, struct rzip_state *st, tag t, i64 p,
+			  i64 end, i64 *offset, i64 *reverse);
+i64 bench_single_match_len(rzip_control *control, struct rzip_state *st, i64 p0, i64 op,
+			   i64 end, i64 *rev);
+double rzip_sample_speed(rzip_control *control, uchar *buf, i64 len);
+int rzip_estimate_matches(rzip_control *control, uchar *buf, i64 len, int nwindows,
+			  const i64 *windows, i64 *matched, i64 *matches, uchar *map);
 
 #endif
@@ -0,0 +1,736 @@
+/*
+   Copyright (C) 2022 Con Kolivas
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Collection of performance counters and the machine readable report
+ * written with --stats-json. Each de/compression job appends a single line
+ * JSON object to the report file so that several files can be processed in
+ * one run. Everything here is a no-op unless control->stats is allocated.
+ *
+ * Also the --trace timeline, which records spans of work on each thread and
+ * writes them in the chrome trace event format for chrome://tracing or
+ * perfetto. Likewise nothing is recorded unless control->trace is set.
+ *
+ * And the --metrics live export, where a thread periodically writes a
+ * snapshot of the job's progress in the prometheus text format, either
+ * atomically replacing a file (suitable for the node exporter textfile
+ * collector) or sent to a listening unix socket. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+#ifdef HAVE_SYS_RESOURCE_H
+# include <sys/resource.h>
+#endif
+#include <time.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "stats.h"
+#include "stream.h"
+#include "util.h"
+#include "lrzip_core.h"
+
+/* Serialises appending to the report files between jobs run with --jobs */
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Monotonic wall clock in seconds */
+double stats_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* CPU time consumed by the calling thread, where the platform supports it */
+double stats_thread_cpu(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+		return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#endif
+	return 0;
+}
+
+static double process_cpu(struct rusage *ru)
+{
+	getrusage(RUSAGE_SELF, ru);
+	return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1000000.0 +
+		ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1000000.0;
+}
+
+bool stats_init(rzip_control *control)
+{
+	struct perf_stats *stats;
+	struct rusage ru;
+
+	if (!control->stats_json)
+		return true;
+	stats = calloc(sizeof(struct perf_stats), 1);
+	if (unlikely(!stats))
+		fatal_return(("Failed to calloc perf_stats in stats_init\n"), false);
+	if (unlikely(!init_mutex(control, &stats->lock))) {
+		dealloc(stats);
+		return false;
+	}
+	stats->start_wall = stats_time();
+	stats->start_cpu = process_cpu(&ru);
+	control->stats = stats;
+	return true;
+}
+
+void stats_free(rzip_control *control)
+{
+	struct perf_stats *stats = control->stats;
+
+	if (!stats)
+		return;
+	pthread_mutex_destroy(&stats->lock);
+	dealloc(stats->chunk);
+	dealloc(stats->block);
+	dealloc(stats);
+	control->stats = NULL;
+}
+
+void stats_add(rzip_control *control, double *counter, double val)
+{
+	lock_mutex(control, &control->stats->lock);
+	*counter += val;
+	unlock_mutex(control, &control->stats->lock);
+}
+
+/* Returns the index of a new chunk record, or 0 if we failed to grow the
+ * array in which case the chunk's figures are merged with the first one. */
+int stats_new_chunk(rzip_control *control)
+{
+	struct perf_stats *stats = control->stats;
+	int ret = 0;
+
+	lock_mutex(control, &stats->lock);
+	if (stats->chunks == stats->chunks_alloced) {
+		int alloced = stats->chunks_alloced * 2 + 8;
+		struct chunk_stats *chunk;
+
+		chunk = realloc(stats->chunk, sizeof(struct chunk_stats) * alloced);
+		if (unlikely(!chunk)) {
+			print_err("Failed to realloc chunk stats, merging chunk figures\n");
+			goto out;
+		}
+		stats->chunk = chunk;
+		stats->chunks_alloced = alloced;
+	}
+	ret = stats->chunks++;
+	memset(&stats->chunk[ret], 0, sizeof(struct chunk_stats));
+out:
+	unlock_mutex(control, &stats->lock);
+	return ret;
+}
+
+/* Store everything but the compressed length, which is accumulated from the
+ * blocks as they complete. */
+void stats_end_chunk(rzip_control *control, int chunk, const struct chunk_stats *cs)
+{
+	struct perf_stats *stats = control->stats;
+	struct chunk_stats *dest;
+
+	lock_mutex(control, &stats->lock);
+	if (likely(chunk < stats->chunks)) {
+		dest = &stats->chunk[chunk];
+		dest->u_len += cs->u_len;
+		dest->rzip_wall += cs->rzip_wall;
+		dest->rzip_cpu += cs->rzip_cpu;
+		dest->matches += cs->matches;
+		dest->match_bytes += cs->match_bytes;
+		dest->literals += cs->literals;
+		dest->literal_bytes += cs->literal_bytes;
+	}
+	stats->rzip_wall += cs->rzip_wall;
+	stats->rzip_cpu += cs->rzip_cpu;
+	unlock_mutex(control, &stats->lock);
+}
+
+void stats_add_block(rzip_control *control, const struct block_stats *bs)
+{
+	struct perf_stats *stats = control->stats;
+
+	lock_mutex(control, &stats->lock);
+	if (stats->blocks == stats->blocks_alloced) {
+		int alloced = stats->blocks_alloced * 2 + 32;
+		struct block_stats *block;
+
+		block = realloc(stats->block, sizeof(struct block_stats) * alloced);
+		if (unlikely(!block)) {
+			print_err("Failed to realloc block stats, dropping block record\n");
+			goto totals;
+		}
+		stats->block = block;
+		stats->blocks_alloced = alloced;
+	}
+	stats->block[stats->blocks++] = *bs;
+totals:
+	if (likely(bs->chunk < stats->chunks))
+		stats->chunk[bs->chunk].c_len += bs->c_len;
+	stats->backend_wall += bs->backend_wall;
+	stats->backend_cpu += bs->backend_cpu;
+	stats->output_wait += bs->output_wait;
+	unlock_mutex(control, &stats->lock);
+}
+
+static const char *ctype_name(uchar c_type)
+{
+	switch (c_type) {
+		case CTYPE_NONE:
+			return "none";
+		case CTYPE_BZIP2:
+			return "bzip2";
+		case CTYPE_LZO:
+			return "lzo";
+		case CTYPE_LZMA:
+			return "lzma";
+		case CTYPE_GZIP:
+			return "gzip";
+		case CTYPE_ZPAQ:
+			return "zpaq";
+	}
+	return "unknown";
+}
+
+static const char *backend_name(rzip_control *control)
+{
+	if (LZMA_COMPRESS)
+		return "lzma";
+	if (LZO_COMPRESS)
+		return "lzo";
+	if (BZIP2_COMPRESS)
+		return "bzip2";
+	if (ZLIB_COMPRESS)
+		return "gzip";
+	if (ZPAQ_COMPRESS)
+		return "zpaq";
+	return "none";
+}
+
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; s && *s; s++) {
+		uchar c = *s;
+
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+static double ratio(i64 u_len, i64 c_len)
+{
+	return c_len ? (double)u_len / c_len : 0;
+}
+
+/* Append the report for this job to control->stats_json and release the
+ * counters. A stats_json of "-" means stderr, as stdout may carry data.
+ * Failing to write the report is not fatal to the job itself. */
+void stats_write(rzip_control *control)
+{
+	struct perf_stats *stats = control->stats;
+	double wall, cpu, util;
+	struct rusage ru;
+	i64 peak_rss;
+	FILE *f;
+	int i;
+
+	if (!stats)
+		return;
+
+	wall = stats_time() - stats->start_wall;
+	cpu = process_cpu(&ru) - stats->start_cpu;
+	peak_rss = ru.ru_maxrss;
+#ifndef __APPLE__
+	peak_rss *= 1024;
+#endif
+	util = wall > 0 ? cpu / (wall * control->threads) : 0;
+
+	pthread_mutex_lock(&report_lock);
+	if (!strcmp(control->stats_json, "-"))
+		f = stderr;
+	else {
+		f = fopen(control->stats_json, "a");
+		if (unlikely(!f)) {
+			pthread_mutex_unlock(&report_lock);
+			print_err("Failed to open %s to write stats\n", control->stats_json);
+			stats_free(control);
+			return;
+		}
+	}
+
+	fprintf(f, "{\"version\":\"%s\",\"mode\":\"%s\",\"infile\":", PACKAGE_VERSION,
+		TEST_ONLY ? "test" : DECOMPRESS ? "decompress" : "compress");
+	json_string(f, STDIN ? "-" : control->infile);
+	fprintf(f, ",\"outfile\":");
+	json_string(f, STDOUT || TEST_ONLY ? "-" : control->outfile);
+	fprintf(f, ",\"backend\":\"%s\",\"level\":%d,\"threads\":%d,\"window\":%"PRId64",\"ramsize\":%"PRId64"",
+		DECOMPRESS ? "auto" : backend_name(control), control->compression_level,
+		control->threads, control->window, control->ramsize);
+	fprintf(f, ",\"in_bytes\":%"PRId64",\"out_bytes\":%"PRId64",\"ratio\":%.4f",
+		stats->in_bytes, stats->out_bytes,
+		DECOMPRESS ? ratio(stats->out_bytes, stats->in_bytes) : ratio(stats->in_bytes, stats->out_bytes));
+	fprintf(f, ",\"wall_seconds\":%.6f,\"cpu_seconds\":%.6f,\"peak_rss_bytes\":%"PRId64",\"thread_utilisation\":%.4f",
+		wall, cpu, peak_rss, util);
+	fprintf(f, ",\"phases\":{\"rzip\":{\"wall\":%.6f,\"cpu\":%.6f}"
+		",\"backend\":{\"wall\":%.6f,\"cpu\":%.6f,\"utilisation\":%.4f}"
+		",\"backend_wait\":{\"wall\":%.6f},\"output_wait\":{\"wall\":%.6f}"
+		",\"io\":{\"wall\":%.6f},\"hashing\":{\"wall\":%.6f,\"cpu\":%.6f}}",
+		stats->rzip_wall, stats->rzip_cpu,
+		stats->backend_wall, stats->backend_cpu,
+		wall > 0 ? stats->backend_cpu / (wall * control->threads) : 0,
+		stats->backend_wait, stats->output_wait, stats->io_wall,
+		stats->hash_wall, stats->hash_cpu);
+	if (!DECOMPRESS)
+		fprintf(f, ",\"hash_table\":{\"tag_hits\":%"PRId64",\"tag_misses\":%"PRId64",\"inserts\":%"PRId64""
+			",\"filter_skips\":%"PRId64",\"filter_false\":%"PRId64"}",
+			stats->tag_hits, stats->tag_misses, stats->inserts,
+			stats->filter_skips, stats->filter_false);
+
+	fprintf(f, ",\"chunks\":[");
+	for (i = 0; i < stats->chunks; i++) {
+		struct chunk_stats *cs = &stats->chunk[i];
+
+		fprintf(f, "%s{\"u_len\":%"PRId64",\"c_len\":%"PRId64",\"ratio\":%.4f,\"rzip_wall\":%.6f,\"rzip_cpu\":%.6f"
+			",\"matches\":%"PRId64",\"match_bytes\":%"PRId64",\"literals\":%"PRId64",\"literal_bytes\":%"PRId64"}",
+			i ? "," : "", cs->u_len, cs->c_len, ratio(cs->u_len, cs->c_len),
+			cs->rzip_wall, cs->rzip_cpu, cs->matches, cs->match_bytes,
+			cs->literals, cs->literal_bytes);
+	}
+	fprintf(f, "],\"blocks\":[");
+	for (i = 0; i < stats->blocks; i++) {
+		struct block_stats *bs = &stats->block[i];
+
+		fprintf(f, "%s{\"chunk\":%d,\"stream\":%d,\"type\":\"%s\",\"u_len\":%"PRId64",\"c_len\":%"PRId64""
+			",\"ratio\":%.4f,\"backend_wall\":%.6f,\"backend_cpu\":%.6f,\"output_wait\":%.6f}",
+			i ? "," : "", bs->chunk, bs->streamno, ctype_name(bs->c_type),
+			bs->u_len, bs->c_len, ratio(bs->u_len, bs->c_len),
+			bs->backend_wall, bs->backend_cpu, bs->output_wait);
+	}
+	fprintf(f, "]}\n");
+
+	if (unlikely(ferror(f)))
+		print_err("Failed to write stats to %s\n", control->stats_json);
+	if (f != stderr && unlikely(fclose(f)))
+		print_err("Failed to close %s\n", control->stats_json);
+	pthread_mutex_unlock(&report_lock);
+	stats_free(control);
+}
+
+bool trace_init(rzip_control *control)
+{
+	struct trace_log *trace;
+
+	if (!control->trace_file)
+		return true;
+	trace = calloc(sizeof(struct trace_log), 1);
+	if (unlikely(!trace))
+		fatal_return(("Failed to calloc trace_log in trace_init\n"), false);
+	if (unlikely(!init_mutex(control, &trace->lock))) {
+		dealloc(trace);
+		return false;
+	}
+	control->trace = trace;
+	return true;
+}
+
+void trace_free(rzip_control *control)
+{
+	struct trace_log *trace = control->trace;
+
+	if (!trace)
+		return;
+	pthread_mutex_destroy(&trace->lock);
+	dealloc(trace->event);
+	dealloc(trace);
+	control->trace = NULL;
+}
+
+/* Record a span from start until now. Name must be a string constant. */
+void trace_span(rzip_control *control, int lane, const char *name, double start, i64 bytes)
+{
+	struct trace_log *trace = control->trace;
+	double end = stats_time();
+	struct trace_event *te;
+
+	lock_mutex(control, &trace->lock);
+	if (trace->events == trace->events_alloced) {
+		int alloced = trace->events_alloced * 2 + 256;
+
+		te = realloc(trace->event, sizeof(struct trace_event) * alloced);
+		if (unlikely(!te))
+			goto out;
+		trace->event = te;
+		trace->events_alloced = alloced;
+	}
+	te = &trace->event[trace->events++];
+	te->name = name;
+	te->lane = lane;
+	te->start = start;
+	te->end = end;
+	te->bytes = bytes;
+	if (lane >= trace->lanes)
+		trace->lanes = lane + 1;
+out:
+	unlock_mutex(control, &trace->lock);
+}
+
+static void trace_lane_name(FILE *f, int pid, int lane)
+{
+	fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"", pid, lane);
+	if (lane == TRACE_RZIP)
+		fprintf(f, "rzip");
+	else if (lane == TRACE_CKSUM)
+		fprintf(f, "checksum");
+	else
+		fprintf(f, "backend %d", lane - TRACE_BACKEND);
+	fprintf(f, "\"}}");
+}
+
+/* Append this job's spans to the trace_file JSON array. Timestamps are
+ * absolute so that several files processed in one run line up. We keep the
+ * array terminated after every job by overwriting the closing bracket on
+ * the next append. */
+void trace_write(rzip_control *control)
+{
+	struct trace_log *trace = control->trace;
+	int i, pid = getpid();
+	long size;
+	FILE *f;
+
+	if (!trace)
+		return;
+
+	pthread_mutex_lock(&report_lock);
+	f = fopen(control->trace_file, "r+");
+	if (!f)
+		f = fopen(control->trace_file, "w+");
+	if (unlikely(!f)) {
+		pthread_mutex_unlock(&report_lock);
+		print_err("Failed to open %s to write trace\n", control->trace_file);
+		trace_free(control);
+		return;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	if (size < 2)
+		fprintf(f, "[\n");
+	else {
+		fseek(f, -2, SEEK_END);
+		fprintf(f, ",\n");
+	}
+
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":", pid);
+	json_string(f, STDIN ? "lrzip -" : control->infile);
+	fprintf(f, "}}");
+	for (i = 0; i < trace->lanes; i++) {
+		fprintf(f, ",\n");
+		trace_lane_name(f, pid, i);
+	}
+	for (i = 0; i < trace->events; i++) {
+		struct trace_event *te = &trace->event[i];
+
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.1f,\"dur\":%.1f,\"args\":{\"bytes\":%"PRId64"}}",
+			te->name, pid, te->lane, te->start * 1000000, (te->end - te->start) * 1000000, te->bytes);
+	}
+	fprintf(f, "\n]");
+
+	if (unlikely(ferror(f)))
+		print_err("Failed to write trace to %s\n", control->trace_file);
+	if (unlikely(fclose(f)))
+		print_err("Failed to close %s\n", control->trace_file);
+	pthread_mutex_unlock(&report_lock);
+	trace_free(control);
+}
+
+#define METRICS_PATH_LEN 4096
+
+static i64 resident_memory(void)
+{
+	struct rusage ru;
+	i64 rss = 0;
+#ifdef __linux
+	long long pages;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%*s %lld", &pages) == 1)
+			rss = pages * PAGE_SIZE;
+		fclose(f);
+	}
+	if (rss)
+		return rss;
+#endif
+	getrusage(RUSAGE_SELF, &ru);
+	rss = ru.ru_maxrss;
+#ifndef __APPLE__
+	rss *= 1024;
+#endif
+	return rss;
+}
+
+static void label_string(char *buf, int len, const char *s)
+{
+	int i = 0;
+
+	for (; s && *s && i < len - 3; s++) {
+		if (*s == '"' || *s == '\\')
+			buf[i++] = '\\';
+		if (*s == '\n') {
+			buf[i++] = '\\';
+			buf[i++] = 'n';
+		} else
+			buf[i++] = *s;
+	}
+	buf[i] = '\0';
+}
+
+/* Fill buf with a prometheus text format snapshot. Call with lock held. */
+static int metrics_snapshot(rzip_control *control, char *buf, int len, bool finished)
+{
+	struct live_metrics *metrics = control->metrics;
+	double now = stats_time(), elapsed, eta = -1;
+	char file[METRICS_PATH_LEN], labels[METRICS_PATH_LEN + 64];
+
+	if (now - metrics->last_time > 0) {
+		metrics->rate = (metrics->done - metrics->last_done) / (now - metrics->last_time);
+		metrics->last_time = now;
+		metrics->last_done = metrics->done;
+	}
+	elapsed = now - metrics->start;
+	if (finished)
+		eta = 0;
+	else if (metrics->expected && metrics->rate > 0)
+		eta = (metrics->expected - metrics->done) / metrics->rate;
+
+	label_string(file, sizeof(file), STDIN ? "-" : control->infile);
+	snprintf(labels, sizeof(labels), "{file=\"%s\",mode=\"%s\"}", file,
+		 DECOMPRESS ? (TEST_ONLY ? "test" : "decompress") : "compress");
+
+	return snprintf(buf, len,
+		"# HELP lrzip_processed_bytes Uncompressed bytes processed so far.\n"
+		"# TYPE lrzip_processed_bytes counter\n"
+		"lrzip_processed_bytes%s %"PRId64"\n"
+		"# HELP lrzip_expected_bytes Total uncompressed bytes, 0 if unknown.\n"
+		"# TYPE lrzip_expected_bytes gauge\n"
+		"lrzip_expected_bytes%s %"PRId64"\n"
+		"# HELP lrzip_compressed_bytes Compressed bytes written or read so far.\n"
+		"# TYPE lrzip_compressed_bytes counter\n"
+		"lrzip_compressed_bytes%s %"PRId64"\n"
+		"# HELP lrzip_throughput_bytes_per_second Current uncompressed throughput.\n"
+		"# TYPE lrzip_throughput_bytes_per_second gauge\n"
+		"lrzip_throughput_bytes_per_second%s %.0f\n"
+		"# HELP lrzip_eta_seconds Estimated time to completion, -1 if unknown.\n"
+		"# TYPE lrzip_eta_seconds gauge\n"
+		"lrzip_eta_seconds%s %.1f\n"
+		"# HELP lrzip_elapsed_seconds Time since the job started.\n"
+		"# TYPE lrzip_elapsed_seconds gauge\n"
+		"lrzip_elapsed_seconds%s %.1f\n"
+		"# HELP lrzip_active_threads Backend threads currently working.\n"
+		"# TYPE lrzip_active_threads gauge\n"
+		"lrzip_active_threads%s %d\n"
+		"# HELP lrzip_resident_memory_bytes Resident memory of the process.\n"
+		"# TYPE lrzip_resident_memory_bytes gauge\n"
+		"lrzip_resident_memory_bytes%s %"PRId64"\n"
+		"# HELP lrzip_chunk Current chunk, counting from 1.\n"
+		"# TYPE lrzip_chunk gauge\n"
+		"lrzip_chunk%s %d\n"
+		"# HELP lrzip_passes Total passes, 0 if unknown.\n"
+		"# TYPE lrzip_passes gauge\n"
+		"lrzip_passes%s %d\n"
+		"# HELP lrzip_finished Whether the job has completed.\n"
+		"# TYPE lrzip_finished gauge\n"
+		"lrzip_finished%s %d\n",
+		labels, metrics->done, labels, metrics->expected,
+		labels, DECOMPRESS ? metrics->bytes_in : metrics->bytes_out,
+		labels, metrics->rate, labels, eta, labels, elapsed,
+		labels, metrics->active_threads, labels, resident_memory(),
+		labels, metrics->chunk, labels, metrics->passes, labels, finished);
+}
+
+/* Replace the metrics file atomically so a scraper never sees a partial
+ * snapshot, or hand the snapshot to whatever listens on a unix: socket. */
+static void metrics_export(rzip_control *control, const char *buf, int len)
+{
+	const char *path = control->metrics_file;
+	char tmpname[METRICS_PATH_LEN];
+	int fd;
+
+	if (!strncmp(path, "unix:", 5)) {
+		struct sockaddr_un sun;
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, path + 5, sizeof(sun.sun_path) - 1);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (unlikely(fd == -1))
+			return;
+		/* Nobody listening is not an error, just nobody to tell */
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) || write(fd, buf, len) != len)
+			print_maxverbose("Unable to send metrics to %s: %s\n", path, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", path);
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (unlikely(fd == -1)) {
+		print_maxverbose("Unable to create %s: %s\n", tmpname, strerror(errno));
+		return;
+	}
+	/* Close whatever the write did so the descriptor is never leaked */
+	if (unlikely(write(fd, buf, len) != len)) {
+		print_maxverbose("Unable to write metrics to %s: %s\n", tmpname, strerror(errno));
+		close(fd);
+		unlink(tmpname);
+		return;
+	}
+	if (unlikely(close(fd))) {
+		print_maxverbose("Unable to close %s: %s\n", tmpname, strerror(errno));
+		unlink(tmpname);
+		return;
+	}
+	if (unlikely(rename(tmpname, path))) {
+		print_maxverbose("Unable to rename %s to %s: %s\n", tmpname, path, strerror(errno));
+		unlink(tmpname);
+	}
+}
+
+static void *metrics_thread(void *data)
+{
+	rzip_control *control = data;
+	struct live_metrics *metrics = control->metrics;
+	char buf[4096 + METRICS_PATH_LEN * 11];
+	struct timespec ts;
+	int len;
+
+	lock_mutex(control, &metrics->lock);
+	while (!metrics->stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += control->metrics_interval;
+		pthread_cond_timedwait(&metrics->cond, &metrics->lock, &ts);
+		if (metrics->stop)
+			break;
+		len = metrics_snapshot(control, buf, sizeof(buf), false);
+		unlock_mutex(control, &metrics->lock);
+		metrics_export(control, buf, MIN(len, (int)sizeof(buf) - 1));
+		lock_mutex(control, &metrics->lock);
+	}
+	unlock_mutex(control, &metrics->lock);
+	return NULL;
+}
+
+bool metrics_start(rzip_control *control)
+{
+	struct live_metrics *metrics;
+
+	if (!control->metrics_file)
+		return true;
+	if (control->metrics_interval < 1)
+		control->metrics_interval = 1;
+	metrics = calloc(sizeof(struct live_metrics), 1);
+	if (unlikely(!metrics))
+		fatal_return(("Failed to calloc live_metrics in metrics_start\n"), false);
+	if (unlikely(!init_mutex(control, &metrics->lock) || !init_cond(control, &metrics->cond))) {
+		dealloc(metrics);
+		return false;
+	}
+	metrics->start = metrics->last_time = stats_time();
+	control->metrics = metrics;
+	if (unlikely(!create_pthread(control, &metrics->pthread, NULL, metrics_thread, control))) {
+		control->metrics = NULL;
+		dealloc(metrics);
+		return false;
+	}
+	return true;
+}
+
+/* Stop the thread and leave a final snapshot showing the job finished */
+void metrics_stop(rzip_control *control)
+{
+	struct live_metrics *metrics = control->metrics;
+	char buf[4096 + METRICS_PATH_LEN * 11];
+	int len;
+
+	if (!metrics)
+		return;
+	lock_mutex(control, &metrics->lock);
+	metrics->stop = true;
+	pthread_cond_broadcast(&metrics->cond);
+	unlock_mutex(control, &metrics->lock);
+	join_pthread(control, metrics->pthread, NULL);
+
+	len = metrics_snapshot(control, buf, sizeof(buf), true);
+	metrics_export(control, buf, MIN(len, (int)sizeof(buf) - 1));
+
+	pthread_mutex_destroy(&metrics->lock);
+	pthread_cond_destroy(&metrics->cond);
+	dealloc(metrics);
+	control->metrics = NULL;
+}
+
+void metrics_progress(rzip_control *control, i64 done)
+{
+	lock_mutex(control, &control->metrics->lock);
+	control->metrics->done = done;
+	unlock_mutex(control, &control->metrics->lock);
+}
+
+void metrics_pass(rzip_control *control, int chunk, int passes, i64 expected)
+{
+	lock_mutex(control, &control->metrics->lock);
+	control->metrics->chunk = chunk;
+	control->metrics->passes = passes;
+	control->metrics->expected = expected;
+	unlock_mutex(control, &control->metrics->lock);
+}
+
+void metrics_io(rzip_control *control, i64 bytes_in, i64 bytes_out)
+{
+	lock_mutex(control, &control->metrics->lock);
+	control->metrics->bytes_in += bytes_in;
+	control->metrics->bytes_out += bytes_out;
+	unlock_mutex(control, &control->metrics->lock);
+}
+
+void metrics_threads(rzip_control *control, int change)
+{
+	lock_mutex(control, &control->metrics->lock);
+	control->metrics->active_threads += change;
+	unlock_mutex(control, &control->metrics->lock);
+}
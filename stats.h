@@ -0,0 +1,45 @@
+/*
+   Copyright (C) 2022 Con Kolivas
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef LRZIP_STATS_H
+#define LRZIP_STATS_H
+
+#include "lrzip_private.h"
+
+double stats_time(void);
+double stats_thread_cpu(void);
+bool stats_init(rzip_control *control);
+void stats_free(rzip_control *control);
+void stats_add(rzip_control *control, double *counter, double val);
+int stats_new_chunk(rzip_control *control);
+void stats_end_chunk(rzip_control *control, int chunk, const struct chunk_stats *cs);
+void stats_add_block(rzip_control *control, const struct block_stats *bs);
+void stats_write(rzip_control *control);
+bool trace_init(rzip_control *control);
+void trace_free(rzip_control *control);
+void trace_span(rzip_control *control, int lane, const char *name, double start, i64 bytes);
+void trace_write(rzip_control *control);
+bool metrics_start(rzip_control *control);
+void metrics_stop(rzip_control *control);
+void metrics_progress(rzip_control *control, i64 done);
+void metrics_pass(rzip_control *control, int chunk, int passes, i64 expected);
+void metrics_io(rzip_control *control, i64 bytes_in, i64 bytes_out);
+void metrics_threads(rzip_control *control, int change);
+
+/* Whether anything wants timestamps taken */
+#define TIMING		(control->stats || control->trace)
+
+#endif
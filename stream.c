@@ -57,13 +57,17 @@
 
 /* LZMA C Wrapper */
 #include "lzma/C/LzmaLib.h"
+#include "lzma/C/LzmaEnc.h"
 
 #include "util.h"
+#include "stats.h"
+#include "numa.h"
+#include "throttle.h"
 #include "lrzip_core.h"
 
 #define STREAM_BUFSIZE (1024 * 1024 * 10)
 
-static struct compress_thread {
+struct compress_thread {
 	uchar *s_buf;	/* Uncompressed buffer -> Compressed buffer */
 	uchar c_type;	/* Compression type */
 	i64 s_len;	/* Data length uncompressed */
@@ -72,7 +76,7 @@ static struct compress_thread {
 	struct stream_info *sinfo;
 	int streamno;
 	uchar salt[SALT_LEN];
-} *cthreads;
+};
 
 typedef struct stream_thread_struct {
 	int i;
@@ -80,10 +84,6 @@ typedef struct stream_thread_struct {
 	struct stream_info *sinfo;
 } stream_thread_struct;
 
-static long output_thread;
-static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t output_cond = PTHREAD_COND_INITIALIZER;
-
 bool init_mutex(rzip_control *control, pthread_mutex_t *mutex)
 {
 	if (unlikely(pthread_mutex_init(mutex, NULL)))
@@ -91,6 +91,47 @@ bool init_mutex(rzip_control *control, pthread_mutex_t *mutex)
 	return true;
 }
 
+bool init_cond(rzip_control *control, pthread_cond_t *cond)
+{
+	if (unlikely(pthread_cond_init(cond, NULL)))
+		fatal_return(("Failed to pthread_cond_init\n"), false);
+	return true;
+}
+
+/* Each lzma backend thread in multithreaded mode keeps about two CPUs busy
+ * with its match finder threads, so only use it when the CPU budget has room
+ * for that on top of one CPU for each block that can be compressed at once,
+ * as with small files or when memory limits the number of threads. */
+static void budget_lzma_threads(rzip_control *control, i64 chunk_limit, i64 bufsize)
+{
+	i64 blocks = (chunk_limit + bufsize - 1) / bufsize;
+	int active = MIN(control->threads, blocks);
+
+	control->lzma_threads = control->cpu_budget >= active * 2 ? 2 : 1;
+	if (LZMA_COMPRESS)
+		print_maxverbose("%d of %d CPUs busy with %d block%s at once, lzma using %s match finder\n",
+				 active * control->lzma_threads, control->cpu_budget, active,
+				 active > 1 ? "s" : "", control->lzma_threads > 1 ? "multithreaded" : "single threaded");
+}
+
+/* Reset the per job state used to serialise the output of the stream
+ * threads */
+bool init_stream_threads(rzip_control *control)
+{
+	control->next_cthread = 0;
+	control->output_thread = 0;
+	if (unlikely(!init_mutex(control, &control->output_lock)))
+		return false;
+	return init_cond(control, &control->output_cond);
+}
+
+/* Once every stream of the job has been closed */
+void fini_stream_threads(rzip_control *control)
+{
+	pthread_cond_destroy(&control->output_cond);
+	pthread_mutex_destroy(&control->output_lock);
+}
+
 bool unlock_mutex(rzip_control *control, pthread_mutex_t *mutex)
 {
 	if (unlikely(pthread_mutex_unlock(mutex)))
@@ -284,11 +325,28 @@ static int gzip_compress_buf(rzip_control *control, struct compress_thread *cthr
 	return 0;
 }
 
+/* A dictionary larger than the whole input only costs time allocating and
+ * initialising the match finder. Only shrink it when the input is small as
+ * the properties of the first block are stored for every block of the file. */
+static unsigned lzma_dict_size(rzip_control *control, int lzma_level)
+{
+	CLzmaEncProps props;
+	unsigned dict_size;
+
+	if (!control->small_input)
+		return 0; /* Default for the level */
+	LzmaEncProps_Init(&props);
+	props.level = lzma_level;
+	for (dict_size = 1 << 12; dict_size < control->st_size; dict_size <<= 1);
+	return MIN(dict_size, LzmaEncProps_GetDictSize(&props));
+}
+
 static int lzma_compress_buf(rzip_control *control, struct compress_thread *cthread)
 {
 	unsigned char lzma_properties[5]; /* lzma properties, encoded */
 	int lzma_level, lzma_ret;
 	size_t prop_size = 5; /* return value for lzma_properties */
+	unsigned dict_size;
 	uchar *c_buf;
 	size_t dlen;
 
@@ -299,6 +357,7 @@ static int lzma_compress_buf(rzip_control *control, struct compress_thread *cthr
 	lzma_level = control->compression_level * 7 / 9;
 	if (!lzma_level)
 		lzma_level = 1;
+	dict_size = lzma_dict_size(control, lzma_level);
 
 	print_maxverbose("Starting lzma back end compression thread...\n");
 retry:
@@ -315,9 +374,9 @@ retry:
 	lzma_ret = LzmaCompress(c_buf, &dlen, cthread->s_buf,
 		(size_t)cthread->s_len, lzma_properties, &prop_size,
 				lzma_level,
-				0, /* dict size. set default, choose by level */
+				dict_size, /* 0 to choose by level */
 				-1, -1, -1, -1, /* lc, lp, pb, fb */
-				control->threads > 1 ? 2: 1);
+				control->lzma_threads);
 				/* LZMA spec has threads = 1 or 2 only. */
 	if (lzma_ret != SZ_OK) {
 		switch (lzma_ret) {
@@ -638,9 +697,13 @@ ssize_t put_fdout(rzip_control *control, void *offset_buf, ssize_t ret)
 ssize_t write_1g(rzip_control *control, void *buf, i64 len)
 {
 	uchar *offset_buf = buf;
+	double start = 0;
 	ssize_t ret;
 	i64 total;
 
+	throttle_write(control, len);
+	if (control->stats)
+		start = stats_time();
 	total = 0;
 	while (len > 0) {
 		if (BITS32)
@@ -648,12 +711,16 @@ ssize_t write_1g(rzip_control *control, void *buf, i64 len)
 		else
 			ret = len;
 		ret = put_fdout(control, offset_buf, (size_t)ret);
-		if (unlikely(ret <= 0))
-			return ret;
+		if (unlikely(ret <= 0)) {
+			total = ret;
+			break;
+		}
 		len -= ret;
 		offset_buf += ret;
 		total += ret;
 	}
+	if (control->stats)
+		stats_add(control, &control->stats->io_wall, stats_time() - start);
 	return total;
 }
 
@@ -665,7 +732,7 @@ static bool read_fdin(struct rzip_control *control, i64 len)
 	i64 i;
 
 	for (i = 0; i < len; i++) {
-		tmpchar = getchar();
+		tmpchar = getc(control->inFILE);
 		if (unlikely(tmpchar == EOF))
 			failure_return(("Reached end of file on STDIN prematurely on read_fdin, asked for %lld got %lld\n",
 				len, i), false);
@@ -690,9 +757,13 @@ static int dump_stdin(rzip_control *control)
 ssize_t read_1g(rzip_control *control, int fd, void *buf, i64 len)
 {
 	uchar *offset_buf = buf;
+	double start = 0;
 	ssize_t ret;
 	i64 total;
 
+	/* Compressing reads the input through mmap so is limited in rzip */
+	if (DECOMPRESS && fd == control->fd_in)
+		throttle_read(control, len);
 	if (TMP_INBUF && fd == control->fd_in) {
 		/* We're decompressing from STDIN */
 		if (unlikely(control->in_ofs + len > control->in_maxlen)) {
@@ -721,6 +792,8 @@ ssize_t read_1g(rzip_control *control, int fd, void *buf, i64 len)
 	}
 
 read_fd:
+	if (control->stats)
+		start = stats_time();
 	total = 0;
 	while (len > 0) {
 		if (BITS32)
@@ -728,12 +801,16 @@ read_fd:
 		else
 			ret = len;
 		ret = read(fd, offset_buf, (size_t)ret);
-		if (unlikely(ret <= 0))
-			return ret;
+		if (unlikely(ret <= 0)) {
+			total = ret;
+			break;
+		}
 		len -= ret;
 		offset_buf += ret;
 		total += ret;
 	}
+	if (control->stats)
+		stats_add(control, &control->stats->io_wall, stats_time() - start);
 	return total;
 }
 
@@ -886,22 +963,26 @@ i64 get_readseek(rzip_control *control, int fd)
 
 bool prepare_streamout_threads(rzip_control *control)
 {
+	struct compress_thread *cthreads;
 	pthread_t *threads;
 	int i;
 
-	/* As we serialise the generation of threads during the rzip
-	 * pre-processing stage, it's faster to have one more thread available
-	 * to keep all CPUs busy. There is no point splitting up the chunks
-	 * into multiple threads if there will be no compression back end. */
-	if (control->threads > 1)
-		++control->threads;
-	if (NO_COMPRESS)
+	/* The CPUs are shared out between the rzip thread, the backend
+	 * threads and lzma's match finder threads so they don't oversubscribe
+	 * them. The rzip thread spends most of its time waiting for a free
+	 * backend thread once they are all busy so it isn't given a CPU of its
+	 * own. There is no point splitting up the chunks into multiple threads
+	 * if there will be no compression back end. */
+	if (!control->cpu_budget)
+		control->cpu_budget = control->threads;
+	control->lzma_threads = 1;
+	if (NO_COMPRESS || control->small_input)
 		control->threads = 1;
 	threads = control->pthreads = calloc(sizeof(pthread_t), control->threads);
 	if (unlikely(!threads))
 		fatal_return(("Unable to calloc threads in prepare_streamout_threads\n"), false);
 
-	cthreads = calloc(sizeof(struct compress_thread), control->threads);
+	cthreads = control->cthreads = calloc(sizeof(struct compress_thread), control->threads);
 	if (unlikely(!cthreads)) {
 		dealloc(threads);
 		fatal_return(("Unable to calloc cthreads in prepare_streamout_threads\n"), false);
@@ -917,8 +998,16 @@ bool prepare_streamout_threads(rzip_control *control)
 
 bool close_streamout_threads(rzip_control *control)
 {
-	int i, close_thread = output_thread;
+	struct compress_thread *cthreads = control->cthreads;
+	int i, close_thread;
+	double start = 0;
+
+	lock_mutex(control, &control->output_lock);
+	close_thread = control->output_thread;
+	unlock_mutex(control, &control->output_lock);
 
+	if (TIMING)
+		start = stats_time();
 	/* Wait for the threads in the correct order in case they end up
 	 * serialised */
 	for (i = 0; i < control->threads; i++) {
@@ -927,7 +1016,11 @@ bool close_streamout_threads(rzip_control *control)
 		if (++close_thread == control->threads)
 			close_thread = 0;
 	}
-	dealloc(cthreads);
+	if (control->stats)
+		stats_add(control, &control->stats->backend_wait, stats_time() - start);
+	if (control->trace)
+		trace_span(control, TRACE_RZIP, "wait for backend", start, 0);
+	dealloc(control->cthreads);
 	dealloc(control->pthreads);
 	return true;
 }
@@ -959,6 +1052,10 @@ void *open_stream_out(rzip_control *control, int f, unsigned int n, i64 chunk_li
 		return NULL;
 	}
 
+	/* A small input is one block per stream, there's nothing to size */
+	if (control->small_input)
+		goto alloc_bufs;
+
 	/* Find the largest we can make the window based on ability to malloc
 	 * ram. We need 2 buffers for each compression thread and the overhead
 	 * of each compression back end. No 2nd buf is required when there is
@@ -994,7 +1091,7 @@ void *open_stream_out(rzip_control *control, int f, unsigned int n, i64 chunk_li
 			limit = one_g - (control->overhead * control->threads);
 	}
 	/* Use a nominal minimum size should we fail all previous shrinking */
-	if (limit < STREAM_BUFSIZE) {
+	if (limit < STREAM_BUFSIZE && limit < chunk_limit) {
 		limit = MAX(limit, STREAM_BUFSIZE);
 		print_output("Warning, low memory for chosen compression settings\n");
 	}
@@ -1028,9 +1125,11 @@ retest_malloc:
 	print_maxverbose("Succeeded in testing %lld sized malloc for back end compression\n", testsize);
 
 	/* Make the bufsize no smaller than STREAM_BUFSIZE. Round up the
-	 * bufsize to fit X threads into it */
-	sinfo->bufsize = MIN(limit, MAX((limit + control->threads - 1) / control->threads,
-					STREAM_BUFSIZE));
+	 * bufsize to fit X threads into it, or smaller still when autotuned */
+	sinfo->bufsize = (limit + control->threads - 1) / control->threads;
+	if (control->tune_bufsize)
+		sinfo->bufsize = MIN(sinfo->bufsize, control->tune_bufsize);
+	sinfo->bufsize = MIN(limit, MAX(sinfo->bufsize, STREAM_BUFSIZE));
 
 	if (control->threads > 1)
 		print_maxverbose("Using up to %d threads to compress up to %lld bytes each.\n",
@@ -1038,7 +1137,9 @@ retest_malloc:
 	else
 		print_maxverbose("Using only 1 thread to compress up to %lld bytes\n",
 			sinfo->bufsize);
+	budget_lzma_threads(control, chunk_limit, sinfo->bufsize);
 
+alloc_bufs:
 	for (i = 0; i < n; i++) {
 		sinfo->s[i].buf = calloc(sinfo->bufsize , 1);
 		if (unlikely(!sinfo->s[i].buf)) {
@@ -1049,6 +1150,8 @@ retest_malloc:
 		}
 	}
 
+	if (control->stats)
+		sinfo->chunk_no = stats_new_chunk(control);
 	return (void *)sinfo;
 }
 
@@ -1088,12 +1191,10 @@ void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 	if (unlikely(!sinfo))
 		return NULL;
 
-	/* We have one thread dedicated to stream 0, and one more thread than
-	 * CPUs to keep them busy, unless we're running single-threaded. */
-	if (control->threads > 1)
-		total_threads = control->threads + 2;
-	else
-		total_threads = control->threads + 1;
+	/* We have one thread dedicated to stream 0, which has little to do,
+	 * and one per CPU for stream 1. The runzip thread mostly waits on them
+	 * so isn't given a CPU of its own. */
+	total_threads = control->threads + 1;
 	threads = control->pthreads = calloc(sizeof(pthread_t), total_threads);
 	if (unlikely(!threads))
 		return NULL;
@@ -1230,6 +1331,8 @@ again:
 		}
 	}
 
+	if (control->stats)
+		sinfo->chunk_no = stats_new_chunk(control);
 	return (void *)sinfo;
 
 failed:
@@ -1293,26 +1396,37 @@ static void *compthread(void *data)
 	struct compress_thread *cti;
 	struct stream_info *ctis;
 	int waited = 0, ret = 0;
+	double start = 0, cpu = 0;
+	struct block_stats bs;
 	i64 padded_len;
 	int write_len;
 
 	/* Make sure this thread doesn't already exist */
 
 	dealloc(data);
-	cti = &cthreads[i];
+	memset(&bs, 0, sizeof(bs));
+	if (control->metrics)
+		metrics_threads(control, 1);
+	cti = &control->cthreads[i];
 	ctis = cti->sinfo;
+	/* Small inputs are compressed inline by the rzip thread so leave its
+	 * placement and priority alone, and there's no ram to be freed up */
+	if (!control->small_input) {
+		/* Backend threads are spread over the nodes after the rzip thread's */
+		nodes_bind_thread(control, i + 1);
+
+		if (unlikely(setpriority(PRIO_PROCESS, 0, control->nice_val) == -1)) {
+			print_err("Warning, unable to set thread nice value %d...Resetting to %d\n", control->nice_val, control->current_priority);
+			setpriority(PRIO_PROCESS, 0, (control->nice_val=control->current_priority));
+		}
 
-	if (unlikely(setpriority(PRIO_PROCESS, 0, control->nice_val) == -1)) {
-		print_err("Warning, unable to set thread nice value %d...Resetting to %d\n", control->nice_val, control->current_priority);
-		setpriority(PRIO_PROCESS, 0, (control->nice_val=control->current_priority));
+		/* Flushing writes to disk frees up any dirty ram, improving
+		 * chances of succeeding in allocating more ram */
+		fsync(ctis->fd);
 	}
 	cti->c_type = CTYPE_NONE;
 	cti->c_len = cti->s_len;
 
-	/* Flushing writes to disk frees up any dirty ram, improving chances
-	 * of succeeding in allocating more ram */
-	fsync(ctis->fd);
-
 	/* This is a cludge in case we are compressing to stdout and our first
 	 * stream is not compressed, but subsequent ones are compressed by
 	 * lzma and we can no longer seek back to the beginning of the file
@@ -1321,11 +1435,16 @@ static void *compthread(void *data)
 	if (TMP_OUTBUF && LZMA_COMPRESS)
 		control->lzma_properties[0] = 93;
 retry:
+	if (TIMING || control->cpu_limit) {
+		start = stats_time();
+		cpu = stats_thread_cpu();
+	}
 	/* Very small buffers have issues to do with minimum amounts of ram
 	 * allocatable to a buffer combined with the MINIMUM_MATCH of rzip
 	 * being 31 bytes so don't bother trying to compress anything less
 	 * than 64 bytes. */
 	if (!NO_COMPRESS && cti->c_len >= 64) {
+		nodes_move_buffer(control, i + 1, cti->s_buf, cti->s_len);
 		if (LZMA_COMPRESS)
 			ret = lzma_compress_buf(control, cti);
 		else if (LZO_COMPRESS)
@@ -1338,6 +1457,14 @@ retry:
 			ret = zpaq_compress_buf(control, cti, i);
 		else failure_goto(("Dunno wtf compression to use!\n"), error);
 	}
+	if (control->stats) {
+		bs.backend_wall += stats_time() - start;
+		bs.backend_cpu += stats_thread_cpu() - cpu;
+	}
+	if (control->trace)
+		trace_span(control, TRACE_BACKEND + i, "compress", start, cti->s_len);
+	if (control->cpu_limit)
+		throttle_cpu(control, stats_thread_cpu() - cpu);
 
 	padded_len = cti->c_len;
 	if (!ret && padded_len < MIN_SIZE) {
@@ -1359,16 +1486,24 @@ retry:
 		failure_goto(("Failed to compress in compthread\n"), error);
 
 	if (!waited) {
-		lock_mutex(control, &output_lock);
-		while (output_thread != i)
-			cond_wait(control, &output_cond, &output_lock);
-		unlock_mutex(control, &output_lock);
+		if (TIMING)
+			start = stats_time();
+		lock_mutex(control, &control->output_lock);
+		while (control->output_thread != i)
+			cond_wait(control, &control->output_cond, &control->output_lock);
+		unlock_mutex(control, &control->output_lock);
+		if (control->stats)
+			bs.output_wait = stats_time() - start;
+		if (control->trace)
+			trace_span(control, TRACE_BACKEND + i, "wait for output", start, 0);
 		waited = 1;
 	}
 	if (unlikely(ret)) {
 		print_maxverbose("Unable to compress in parallel, waiting for previous thread to complete before trying again\n");
 		goto retry;
 	}
+	if (control->trace)
+		start = stats_time();
 
 	/* Need to be big enough to fill one CBC_LEN */
 	if (ENCRYPT)
@@ -1474,13 +1609,28 @@ retry:
 	ctis->cur_pos += padded_len;
 	dealloc(cti->s_buf);
 
-	lock_mutex(control, &output_lock);
-	if (++output_thread == control->threads)
-		output_thread = 0;
-	cond_broadcast(control, &output_cond);
-	unlock_mutex(control, &output_lock);
+	if (control->stats) {
+		bs.chunk = ctis->chunk_no;
+		bs.streamno = cti->streamno;
+		bs.c_type = cti->c_type;
+		bs.u_len = cti->s_len;
+		bs.c_len = cti->c_len;
+		stats_add_block(control, &bs);
+	}
+	if (control->trace)
+		trace_span(control, TRACE_BACKEND + i, "write", start, padded_len);
+	if (control->metrics)
+		metrics_io(control, 0, padded_len);
+
+	lock_mutex(control, &control->output_lock);
+	if (++control->output_thread == control->threads)
+		control->output_thread = 0;
+	cond_broadcast(control, &control->output_cond);
+	unlock_mutex(control, &control->output_lock);
 
 error:
+	if (control->metrics)
+		metrics_threads(control, -1);
 	cksem_post(control, &cti->cksem);
 
 	return NULL;
@@ -1488,12 +1638,20 @@ error:
 
 static void clear_buffer(rzip_control *control, struct stream_info *sinfo, int streamno, int newbuf)
 {
+	struct compress_thread *cthreads = control->cthreads;
 	pthread_t *threads = control->pthreads;
+	int i = control->next_cthread;
 	stream_thread_struct *s;
-	static int i = 0;
+	double start = 0;
 
 	/* Make sure this thread doesn't already exist */
+	if (TIMING)
+		start = stats_time();
 	cksem_wait(control, &cthreads[i].cksem);
+	if (control->stats)
+		stats_add(control, &control->stats->backend_wait, stats_time() - start);
+	if (control->trace)
+		trace_span(control, TRACE_RZIP, "clear_buffer handoff", start, sinfo->s[streamno].buflen);
 
 	cthreads[i].sinfo = sinfo;
 	cthreads[i].streamno = streamno;
@@ -1510,8 +1668,10 @@ static void clear_buffer(rzip_control *control, struct stream_info *sinfo, int s
 	}
 	s->i = i;
 	s->control = control;
-	if (unlikely((!create_pthread(control, &threads[i], NULL, compthread, s)) ||
-	             (!detach_pthread(control, &threads[i]))))
+	if (control->small_input)
+		compthread(s);
+	else if (unlikely((!create_pthread(control, &threads[i], NULL, compthread, s)) ||
+			  (!detach_pthread(control, &threads[i]))))
 		failure("Unable to create compthread in clear_buffer");
 
 	if (newbuf) {
@@ -1525,6 +1685,7 @@ static void clear_buffer(rzip_control *control, struct stream_info *sinfo, int s
 
 	if (++i == control->threads)
 		i = 0;
+	control->next_cthread = i;
 }
 
 /* flush out any data in a stream buffer */
@@ -1539,8 +1700,16 @@ static void *ucompthread(void *data)
 	rzip_control *control = sts->control;
 	int waited = 0, ret = 0, i = sts->i;
 	struct uncomp_thread *uci = &sts->sinfo->ucthreads[i];
+	double start = 0, cpu = 0;
+	struct block_stats bs;
 
+	memset(&bs, 0, sizeof(bs));
+	bs.chunk = sts->sinfo->chunk_no;
 	dealloc(data);
+	if (control->metrics)
+		metrics_threads(control, 1);
+	/* Decompressed buffers are allocated here so land on this node */
+	nodes_bind_thread(control, i + 1);
 
 	if (unlikely(setpriority(PRIO_PROCESS, 0, control->nice_val) == -1)) {
 		print_err("Warning, unable to set thread nice value %d...Resetting to %d\n", control->nice_val, control->current_priority);
@@ -1548,6 +1717,10 @@ static void *ucompthread(void *data)
 	}
 
 retry:
+	if (TIMING || control->cpu_limit) {
+		start = stats_time();
+		cpu = stats_thread_cpu();
+	}
 	if (uci->c_type != CTYPE_NONE) {
 		switch (uci->c_type) {
 			case CTYPE_LZMA:
@@ -1570,6 +1743,14 @@ retry:
 				break;
 		}
 	}
+	if (control->stats) {
+		bs.backend_wall += stats_time() - start;
+		bs.backend_cpu += stats_thread_cpu() - cpu;
+	}
+	if (control->trace)
+		trace_span(control, TRACE_BACKEND + i, "decompress", start, uci->u_len);
+	if (control->cpu_limit)
+		throttle_cpu(control, stats_thread_cpu() - cpu);
 
 	/* As per compression, serialise the decompression if it fails in
 	 * parallel */
@@ -1580,16 +1761,32 @@ retry:
 		/* We do not strictly need to wait for this, so it's used when
 		 * decompression fails due to inadequate memory to try again
 		 * serialised. */
-		lock_mutex(control, &output_lock);
-		while (output_thread != i)
-			cond_wait(control, &output_cond, &output_lock);
-		unlock_mutex(control, &output_lock);
+		if (TIMING)
+			start = stats_time();
+		lock_mutex(control, &control->output_lock);
+		while (control->output_thread != i)
+			cond_wait(control, &control->output_cond, &control->output_lock);
+		unlock_mutex(control, &control->output_lock);
+		if (control->stats)
+			bs.output_wait += stats_time() - start;
+		if (control->trace)
+			trace_span(control, TRACE_BACKEND + i, "wait for output", start, 0);
 		waited = 1;
 		goto retry;
 	}
 
 	print_maxverbose("Thread %ld decompressed %lld bytes from stream %d\n", i, uci->u_len, uci->streamno);
 
+	if (control->stats) {
+		bs.streamno = uci->streamno;
+		bs.c_type = uci->c_type;
+		bs.u_len = uci->u_len;
+		bs.c_len = uci->c_len;
+		stats_add_block(control, &bs);
+	}
+	if (control->metrics)
+		metrics_threads(control, -1);
+
 	return NULL;
 }
 
@@ -1602,6 +1799,7 @@ static int fill_buffer(rzip_control *control, struct stream_info *sinfo, struct
 	pthread_t *threads = control->pthreads;
 	stream_thread_struct *sts;
 	uchar c_type, *s_buf;
+	double start = 0;
 	void *thr_return;
 
 	dealloc(s->buf);
@@ -1694,10 +1892,16 @@ fill_another:
 		fatal_return(("Unable to malloc buffer of size %lld in fill_buffer\n", u_len), -1);
 	sinfo->ram_alloced += u_len;
 
+	if (control->trace)
+		start = stats_time();
 	if (unlikely(read_buf(control, sinfo->fd, s_buf, padded_len))) {
 		dealloc(s_buf);
 		return -1;
 	}
+	if (control->trace)
+		trace_span(control, TRACE_RZIP, "fill_buffer read", start, padded_len);
+	if (control->metrics)
+		metrics_io(control, padded_len, 0);
 
 	if (unlikely(ENCRYPT && !lrz_decrypt(control, s_buf, padded_len, blocksalt))) {
 		dealloc(s_buf);
@@ -1740,15 +1944,21 @@ skip_empty:
 		 sinfo->ram_alloced < control->maxram)
 			goto fill_another;
 out:
-	lock_mutex(control, &output_lock);
-	output_thread = s->unext_thread;
-	cond_broadcast(control, &output_cond);
-	unlock_mutex(control, &output_lock);
+	lock_mutex(control, &control->output_lock);
+	control->output_thread = s->unext_thread;
+	cond_broadcast(control, &control->output_cond);
+	unlock_mutex(control, &control->output_lock);
 
 	/* join_pthread here will make it wait till the data is ready */
 	thr_return = NULL;
+	if (TIMING)
+		start = stats_time();
 	if (unlikely(!join_pthread(control, threads[s->unext_thread], &thr_return) || !!thr_return))
 		return -1;
+	if (control->stats)
+		stats_add(control, &control->stats->backend_wait, stats_time() - start);
+	if (control->trace)
+		trace_span(control, TRACE_RZIP, "wait for backend", start, 0);
 	ucthreads[s->unext_thread].busy = 0;
 
 	print_maxverbose("Taking decompressed data from thread %ld\n", s->unext_thread);
@@ -1832,7 +2042,12 @@ int close_stream_out(rzip_control *control, void *ss)
 		/* Last two compressed blocks do not have an offset written
 		 * to them so we have to go back and encrypt them now, but we
 		 * must wait till the threads return. */
-		int close_thread = output_thread;
+		struct compress_thread *cthreads = control->cthreads;
+		int close_thread;
+
+		lock_mutex(control, &control->output_lock);
+		close_thread = control->output_thread;
+		unlock_mutex(control, &control->output_lock);
 
 		for (i = 0; i < control->threads; i++) {
 			cksem_wait(control, &cthreads[close_thread].cksem);
@@ -1884,7 +2099,7 @@ int close_stream_in(rzip_control *control, void *ss)
 	for (i = 0; i < sinfo->num_streams; i++)
 		dealloc(sinfo->s[i].buf);
 
-	output_thread = 0;
+	control->output_thread = 0;
 	/* We cannot safely release the sinfo and pthread data here till all
 	 * threads are shut down. */
 	add_to_rulist(control, sinfo);
@@ -1943,3 +2158,81 @@ static int lz4_compresses(rzip_control *control, uchar *s_buf, i64 s_len)
 
 	return ret;
 }
+
+/* Trial runs of the backends outside of the stream threads, for --estimate
+ * and the microbenchmarks. Compress len bytes of *buf with the backend for
+ * c_type, replacing *buf with the compressed buffer and returning its
+ * length, or len if it was left uncompressed. */
+i64 trial_compress_buf(rzip_control *control, uchar c_type, uchar **buf, i64 len)
+{
+	struct compress_thread cthread;
+	int ret;
+
+	memset(&cthread, 0, sizeof(cthread));
+	cthread.s_buf = *buf;
+	cthread.s_len = cthread.c_len = len;
+	cthread.c_type = CTYPE_NONE;
+	switch (c_type) {
+		case CTYPE_LZMA:
+			ret = lzma_compress_buf(control, &cthread);
+			break;
+		case CTYPE_LZO:
+			if (unlikely(lzo_init() != LZO_E_OK))
+				return -1;
+			ret = lzo_compress_buf(control, &cthread);
+			break;
+		case CTYPE_BZIP2:
+			ret = bzip2_compress_buf(control, &cthread);
+			break;
+		case CTYPE_GZIP:
+			ret = gzip_compress_buf(control, &cthread);
+			break;
+		case CTYPE_ZPAQ:
+			ret = zpaq_compress_buf(control, &cthread, 0);
+			break;
+		default:
+			return len;
+	}
+	*buf = cthread.s_buf;
+	return ret ? -1 : cthread.c_len;
+}
+
+/* Decompress c_len bytes of *buf compressed with c_type back to u_len bytes,
+ * replacing *buf with the decompressed buffer */
+bool trial_decompress_buf(rzip_control *control, uchar c_type, uchar **buf, i64 c_len, i64 u_len)
+{
+	struct uncomp_thread ucthread;
+	int ret;
+
+	memset(&ucthread, 0, sizeof(ucthread));
+	ucthread.s_buf = *buf;
+	ucthread.c_len = c_len;
+	ucthread.u_len = u_len;
+	ucthread.c_type = c_type;
+	switch (c_type) {
+		case CTYPE_LZMA:
+			ret = lzma_decompress_buf(control, &ucthread);
+			break;
+		case CTYPE_LZO:
+			ret = lzo_decompress_buf(control, &ucthread);
+			break;
+		case CTYPE_BZIP2:
+			ret = bzip2_decompress_buf(control, &ucthread);
+			break;
+		case CTYPE_GZIP:
+			ret = gzip_decompress_buf(control, &ucthread);
+			break;
+		case CTYPE_ZPAQ:
+			ret = zpaq_decompress_buf(control, &ucthread, 0);
+			break;
+		default:
+			return true;
+	}
+	*buf = ucthread.s_buf;
+	return !ret;
+}
+
+int trial_lz4_compresses(rzip_control *control, uchar *buf, i64 len)
+{
+	return lz4_compresses(control, buf, len);
+}
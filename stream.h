@@ -25,8 +25,11 @@
 
 bool create_pthread(rzip_control *control, pthread_t *thread, pthread_attr_t * attr,
 	void * (*start_routine)(void *), void *arg);
-bool join_pthread(pthread_t th, void **thread_return);
+bool join_pthread(rzip_control *control, pthread_t th, void **thread_return);
 bool init_mutex(rzip_control *control, pthread_mutex_t *mutex);
+bool init_cond(rzip_control *control, pthread_cond_t *cond);
+bool init_stream_threads(rzip_control *control);
+void fini_stream_threads(rzip_control *control);
 bool unlock_mutex(rzip_control *control, pthread_mutex_t *mutex);
 bool lock_mutex(rzip_control *control, pthread_mutex_t *mutex);
 ssize_t write_1g(rzip_control *control, void *buf, i64 len);
@@ -42,5 +45,8 @@ i64 read_stream(rzip_control *control, void *ss, int streamno, uchar *p, i64 len
 int close_stream_out(rzip_control *control, void *ss);
 int close_stream_in(rzip_control *control, void *ss);
 ssize_t put_fdout(rzip_control *control, void *offset_buf, ssize_t ret);
+i64 trial_compress_buf(rzip_control *control, uchar c_type, uchar **buf, i64 len);
+bool trial_decompress_buf(rzip_control *control, uchar c_type, uchar **buf, i64 c_len, i64 u_len);
+int trial_lz4_compresses(rzip_control *control, uchar *buf, i64 len);
 
 #endif
@@ -0,0 +1,224 @@
+/*
+   Copyright (C) 2022 Con Kolivas
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Run a number of compression and decompression jobs concurrently within the
+ * one process, each with its own control, sharing out the cpus and ram
+ * between them, and check every job round trips its data intact. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "lrzip_core.h"
+#include "util.h"
+/* needed for CRC routines */
+#include "lzma/C/7zCrc.h"
+
+#define DEFAULT_JOBS	4
+#define DEFAULT_MB	8
+
+struct job {
+	pthread_t pthread;
+	int id;
+	int threads;
+	i64 ramsize;
+	i64 size;
+	unsigned long flags;
+	char dir[64];
+	char infile[128];
+	char lrzfile[128];
+	char outfile[128];
+	bool ok;
+};
+
+/* Deterministic input per job with some long range redundancy for rzip to
+ * find and some short range redundancy for the back end */
+static bool write_input(struct job *job)
+{
+	unsigned int seed = 0x9e3779b9 * (job->id + 1);
+	i64 i, block = 65536;
+	uchar *buf;
+	bool ret;
+	int fd;
+
+	buf = malloc(job->size);
+	if (!buf)
+		return false;
+	for (i = 0; i < job->size; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = "lrzip stress "[(seed >> 16) % 13];
+		if (!(seed & 0x300))
+			buf[i] = seed >> 24;
+	}
+	/* Repeat earlier blocks further along */
+	for (i = job->size / 2; i + block <= job->size; i += block * 3)
+		memcpy(buf + i, buf + (i - job->size / 2), block);
+
+	fd = open(job->infile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		dealloc(buf);
+		return false;
+	}
+	ret = write(fd, buf, job->size) == job->size;
+	close(fd);
+	dealloc(buf);
+	return ret;
+}
+
+static bool same_files(const char *a, const char *b)
+{
+	FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+	bool ret = fa && fb;
+	int ca, cb;
+
+	while (ret) {
+		ca = getc(fa);
+		cb = getc(fb);
+		if (ca != cb)
+			ret = false;
+		if (ca == EOF || cb == EOF)
+			break;
+	}
+	if (fa)
+		fclose(fa);
+	if (fb)
+		fclose(fb);
+	return ret;
+}
+
+static bool setup_job_control(rzip_control *control, struct job *job, char *infile, char *outname)
+{
+	if (!initialise_control(control))
+		return false;
+	control->flags &= ~FLAG_SHOW_PROGRESS;
+	control->flags |= FLAG_FORCE_REPLACE | job->flags;
+	control->msgout = NULL;
+	control->threads = job->threads;
+	control->ramsize = job->ramsize;
+	control->infile = infile;
+	control->outname = outname;
+	setup_overhead(control);
+	setup_ram(control);
+	return true;
+}
+
+static void *run_job(void *data)
+{
+	struct job *job = data;
+	rzip_control *control;
+
+	control = calloc(sizeof(rzip_control), 1);
+	if (!control)
+		return NULL;
+
+	if (!setup_job_control(control, job, job->infile, job->lrzfile) ||
+	    !compress_file(control))
+		goto out;
+	dealloc(control->tmpdir);
+
+	if (!setup_job_control(control, job, job->lrzfile, job->outfile))
+		goto out;
+	control->flags |= FLAG_DECOMPRESS;
+	if (!decompress_file(control))
+		goto out;
+
+	job->ok = same_files(job->infile, job->outfile);
+out:
+	dealloc(control->tmpdir);
+	dealloc(control);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned long backends[] = {
+		0, FLAG_BZIP2_COMPRESS, FLAG_ZLIB_COMPRESS, FLAG_LZO_COMPRESS, FLAG_NO_COMPRESS
+	};
+	int jobs = DEFAULT_JOBS, mb = DEFAULT_MB, cpus, i, failed = 0;
+	rzip_control probe;
+	struct job *job;
+
+	if (argc > 1)
+		jobs = atoi(argv[1]);
+	if (argc > 2)
+		mb = atoi(argv[2]);
+	if (jobs < 1 || mb < 1) {
+		fprintf(stderr, "Usage: %s [jobs] [size in MB]\n", argv[0]);
+		return 2;
+	}
+
+	CrcGenerateTable();
+	if (!initialise_control(&probe))
+		return 1;
+	free(probe.tmpdir);
+
+	job = calloc(sizeof(struct job), jobs);
+	if (!job)
+		return 1;
+
+	/* Share the cpus and ram between all the jobs */
+	cpus = PROCESSORS;
+	for (i = 0; i < jobs; i++) {
+		job[i].id = i;
+		job[i].threads = MAX(cpus / jobs, 1);
+		job[i].ramsize = probe.ramsize / jobs;
+		job[i].size = (i64)mb * 1024 * 1024 + i * 4099;
+		job[i].flags = backends[i % (sizeof(backends) / sizeof(backends[0]))];
+		strcpy(job[i].dir, "stresstest.XXXXXX");
+		if (!mkdtemp(job[i].dir)) {
+			fprintf(stderr, "Failed to create directory for job %d\n", i);
+			return 1;
+		}
+		sprintf(job[i].infile, "%s/in", job[i].dir);
+		sprintf(job[i].lrzfile, "%s/in.lrz", job[i].dir);
+		sprintf(job[i].outfile, "%s/out", job[i].dir);
+		if (!write_input(&job[i])) {
+			fprintf(stderr, "Failed to write input for job %d\n", i);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&job[i].pthread, NULL, run_job, &job[i])) {
+			fprintf(stderr, "Failed to create thread for job %d\n", i);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < jobs; i++) {
+		pthread_join(job[i].pthread, NULL);
+		if (!job[i].ok) {
+			fprintf(stderr, "Job %d failed to round trip %s\n", i, job[i].infile);
+			failed++;
+			continue;
+		}
+		unlink(job[i].infile);
+		unlink(job[i].lrzfile);
+		unlink(job[i].outfile);
+		rmdir(job[i].dir);
+	}
+
+	printf("%d of %d concurrent jobs succeeded\n", jobs - failed, jobs);
+	free(job);
+	return !!failed;
+}
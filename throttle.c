@@ -0,0 +1,176 @@
+/*
+   Copyright (C) 2022 Con Kolivas
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Resource limits for running lrzip in the background next to other work.
+ * Read and write bandwidth are limited with a token bucket each, allowed to
+ * go into debt so that a large buffer can be written in one go with the
+ * sleep taken afterwards. The io priority is set once for the job and is
+ * inherited by every thread it creates. The CPU cap is a duty cycle, each
+ * thread sleeping after a unit of work in proportion to the CPU it used. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <time.h>
+#include <errno.h>
+#include <strings.h>
+#ifdef __linux
+# include <sys/syscall.h>
+#endif
+
+#include "throttle.h"
+#include "stats.h"
+#include "stream.h"
+#include "util.h"
+
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_CLASS_BE		2
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_WHO_PROCESS	1
+
+struct token_bucket {
+	pthread_mutex_t lock;
+	double rate;	/* Bytes per second, 0 for unlimited */
+	double tokens;	/* Negative when in debt */
+	double last;
+};
+
+struct throttle {
+	struct token_bucket read, write;
+};
+
+static void nap(double secs)
+{
+	struct timespec ts;
+
+	if (secs <= 0)
+		return;
+	ts.tv_sec = secs;
+	ts.tv_nsec = (secs - ts.tv_sec) * 1000000000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+/* Accepts idle, or best-effort optionally followed by :level 0-7 */
+bool parse_ionice(rzip_control *control, const char *arg)
+{
+	const char *level;
+	size_t len;
+
+	if (!strcasecmp(arg, "idle")) {
+		control->ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+		return true;
+	}
+	level = strchr(arg, ':');
+	len = level ? (size_t)(level - arg) : strlen(arg);
+	if (len != strlen("best-effort") || strncasecmp(arg, "best-effort", len))
+		return false;
+	/* 4 is the kernel's default level within a class */
+	control->ioprio = IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | 4;
+	if (level) {
+		char *endptr;
+		long l = strtol(level + 1, &endptr, 10);
+
+		if (endptr == level + 1 || *endptr || l < 0 || l > 7)
+			return false;
+		control->ioprio = IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | l;
+	}
+	return true;
+}
+
+bool throttle_init(rzip_control *control)
+{
+	struct throttle *throttle;
+
+	if (control->ioprio) {
+#ifdef __linux
+		if (unlikely(syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, control->ioprio)))
+			print_err("Warning, unable to set io priority\n");
+#else
+		print_err("Warning, io priority is only supported on linux\n");
+#endif
+	}
+	if (!control->read_limit && !control->write_limit)
+		return true;
+	throttle = calloc(sizeof(*throttle), 1);
+	if (unlikely(!throttle))
+		fatal_return(("Failed to calloc throttle in throttle_init\n"), false);
+	if (unlikely(!init_mutex(control, &throttle->read.lock) ||
+		     !init_mutex(control, &throttle->write.lock))) {
+		dealloc(throttle);
+		return false;
+	}
+	throttle->read.rate = control->read_limit;
+	throttle->write.rate = control->write_limit;
+	throttle->read.last = throttle->write.last = stats_time();
+	control->throttle = throttle;
+	return true;
+}
+
+void throttle_free(rzip_control *control)
+{
+	struct throttle *throttle = control->throttle;
+
+	if (!throttle)
+		return;
+	pthread_mutex_destroy(&throttle->read.lock);
+	pthread_mutex_destroy(&throttle->write.lock);
+	dealloc(control->throttle);
+}
+
+/* Take bytes from the bucket, sleeping for as long as it is in debt. Up to a
+ * second's worth of tokens can be saved up when idle. */
+static void take_tokens(struct token_bucket *tb, i64 bytes)
+{
+	double now, wait = 0;
+
+	if (!tb->rate)
+		return;
+	pthread_mutex_lock(&tb->lock);
+	now = stats_time();
+	tb->tokens = MIN(tb->tokens + (now - tb->last) * tb->rate, tb->rate);
+	tb->last = now;
+	tb->tokens -= bytes;
+	if (tb->tokens < 0)
+		wait = -tb->tokens / tb->rate;
+	pthread_mutex_unlock(&tb->lock);
+	nap(wait);
+}
+
+void throttle_read(rzip_control *control, i64 bytes)
+{
+	if (control->throttle)
+		take_tokens(&control->throttle->read, bytes);
+}
+
+void throttle_write(rzip_control *control, i64 bytes)
+{
+	if (control->throttle)
+		take_tokens(&control->throttle->write, bytes);
+}
+
+/* Having used cpu seconds, sleep for long enough that the calling thread
+ * runs for no more than cpu_limit percent of the time */
+void throttle_cpu(rzip_control *control, double cpu)
+{
+	if (control->cpu_limit && control->cpu_limit < 100)
+		nap(cpu * (100 - control->cpu_limit) / control->cpu_limit);
+}
@@ -0,0 +1,29 @@
+/*
+   Copyright (C) 2022 Con Kolivas
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef LRZIP_THROTTLE_H
+#define LRZIP_THROTTLE_H
+
+#include "lrzip_private.h"
+
+bool parse_ionice(rzip_control *control, const char *arg);
+bool throttle_init(rzip_control *control);
+void throttle_free(rzip_control *control);
+void throttle_read(rzip_control *control, i64 bytes);
+void throttle_write(rzip_control *control, i64 bytes);
+void throttle_cpu(rzip_control *control, double cpu);
+
+#endif
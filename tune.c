@@ -0,0 +1,411 @@
+/*
+   Copyright (C) 2022 Con Kolivas
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The --autotune mode. The rzip stage, one backend thread and all of them at
+ * once are timed on a synthetic corpus, and the throughputs are cached per
+ * backend and level in ~/.lrzip/profile along with a description of the
+ * hardware. The profile is discarded when the hardware description changes,
+ * so a new CPU, more ram or a new version of lrzip calibrates again. Only
+ * what was detected goes in the description, not -m or the share of --jobs,
+ * and each calibration is merged into whatever other jobs have saved.
+ *
+ * From the throughputs, only as many backend threads are used as are needed
+ * to keep up with the rzip stage, blocks are kept to about two seconds of
+ * backend time so the backends start early in each chunk instead of all
+ * waiting for a share of the whole chunk, at some cost in ratio, and
+ * the ram the backends then don't need is given to the main buffer so that
+ * more of each window is searched without the slower sliding mmap. */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#include <limits.h>
+#include <math.h>
+#include <inttypes.h>
+
+#include "tune.h"
+#include "lrzip_core.h"
+#include "rzip.h"
+#include "stream.h"
+#include "stats.h"
+#include "util.h"
+
+#define TUNE_CORPUS	(8 * 1024 * 1024) // Synthetic input timed with rzip
+#define TUNE_BLOCK	(1024 * 1024) // Input to each backend trial
+#define TUNE_BLOCKS	(4) // Trials per thread
+#define TUNE_BLOCK_SECS	(2.0) // Backend time to aim for per block
+#define TUNE_ENTRIES	(64)
+
+struct tune_entry {
+	char backend[8];
+	int level;
+	int threads;		/* Threads the parallel rate was measured with */
+	double rzip_bps;	/* Bytes per second of input through rzip */
+	double backend_bps;	/* Of one backend thread on its own */
+	double parallel_bps;	/* Per thread with all running at once */
+};
+
+struct tune_trial {
+	rzip_control *control;
+	uchar c_type;
+	const uchar *block;
+	bool ok;
+};
+
+static const char *backend_name(rzip_control *control, uchar *c_type)
+{
+	if (NO_COMPRESS) {
+		*c_type = CTYPE_NONE;
+		return "none";
+	} else if (LZO_COMPRESS) {
+		*c_type = CTYPE_LZO;
+		return "lzo";
+	} else if (BZIP2_COMPRESS) {
+		*c_type = CTYPE_BZIP2;
+		return "bzip2";
+	} else if (ZLIB_COMPRESS) {
+		*c_type = CTYPE_GZIP;
+		return "gzip";
+	} else if (ZPAQ_COMPRESS) {
+		*c_type = CTYPE_ZPAQ;
+		return "zpaq";
+	}
+	*c_type = CTYPE_LZMA;
+	return "lzma";
+}
+
+/* The CPUs are those this run may use, after any affinity mask or cgroup
+ * quota, as a profile from one container is no good under another quota */
+static void hardware_id(rzip_control *control, char *buf, int len)
+{
+	const char *limit = control->threads_limit;
+	i64 ramsize = get_ram(control);
+	char line[256], model[128] = "unknown";
+	int cpus;
+	FILE *f;
+
+	/* get_cpus records what limited it, which -p may have cleared */
+	cpus = get_cpus(control);
+	control->threads_limit = limit;
+
+	f = fopen("/proc/cpuinfo", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			char *p = strchr(line, ':');
+
+			if (strncmp(line, "model name", 10) || !p)
+				continue;
+			for (p++; *p == ' '; p++);
+			p[strcspn(p, "\n")] = '\0';
+			snprintf(model, sizeof(model), "%s", p);
+			break;
+		}
+		fclose(f);
+	}
+	snprintf(buf, len, "%s, %d cpus, %"PRId64" MB ram, lrzip %s", model,
+		 cpus, ramsize > 0 ? ramsize >> 20 : 0, PACKAGE_VERSION);
+}
+
+static bool profile_path(char *buf, int len)
+{
+	char *home = getenv("HOME");
+
+	if (!home)
+		return false;
+	snprintf(buf, len, "%s/.lrzip/profile", home);
+	return true;
+}
+
+/* Read the entries of the profile, none if it describes other hardware */
+static int load_profile(const char *path, const char *hwid, struct tune_entry *te)
+{
+	char line[512], id[sizeof(line)] = "";
+	int n = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f) && n < TUNE_ENTRIES) {
+		line[strcspn(line, "\n")] = '\0';
+		if (*line == '#')
+			continue;
+		if (!strncmp(line, "hardware = ", 11)) {
+			snprintf(id, sizeof(id), "%s", line + 11);
+			continue;
+		}
+		if (sscanf(line, "%7s %d %d %lf %lf %lf", te[n].backend, &te[n].level, &te[n].threads,
+			   &te[n].rzip_bps, &te[n].backend_bps, &te[n].parallel_bps) == 6)
+			n++;
+	}
+	fclose(f);
+	return strcmp(id, hwid) ? 0 : n;
+}
+
+/* Merge e into the entries already saved by any job on this hardware */
+static void save_profile(rzip_control *control, const char *path, const char *hwid,
+			 struct tune_entry *e)
+{
+	char tmp[PATH_MAX + 8], dir[PATH_MAX], *slash;
+	struct tune_entry te[TUNE_ENTRIES];
+	int fd, n, i;
+	FILE *f;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	slash = strrchr(dir, '/');
+	if (slash) {
+		*slash = '\0';
+		mkdir(dir, 0755);
+	}
+	n = load_profile(path, hwid, te);
+	for (i = 0; i < n; i++) {
+		if (!strcmp(te[i].backend, e->backend) && te[i].level == e->level &&
+		    te[i].threads == e->threads)
+			break;
+	}
+	if (i == TUNE_ENTRIES)
+		i--;
+	memcpy(&te[i], e, sizeof(*e));
+	if (i == n)
+		n++;
+
+	/* Jobs running at once each write their own file and rename it over
+	 * the profile, so none of them ever reads a partial one */
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		print_err("Warning, unable to write autotune profile %s\n", path);
+		return;
+	}
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp);
+		print_err("Warning, unable to write autotune profile %s\n", path);
+		return;
+	}
+	fprintf(f, "# lrzip autotune profile, recalibrated when the hardware changes\n");
+	fprintf(f, "# backend level threads rzip_bytes/s backend_bytes/s parallel_bytes/s\n");
+	fprintf(f, "hardware = %s\n", hwid);
+	for (i = 0; i < n; i++)
+		fprintf(f, "%s %d %d %.0f %.0f %.0f\n", te[i].backend, te[i].level, te[i].threads,
+			te[i].rzip_bps, te[i].backend_bps, te[i].parallel_bps);
+	if (unlikely(fclose(f) || rename(tmp, path))) {
+		unlink(tmp);
+		print_err("Warning, unable to write autotune profile %s\n", path);
+	}
+}
+
+/* Text like data from a skewed vocabulary of words, with an occasional
+ * repeat of an earlier stretch for rzip to find. Always the same. */
+static void make_corpus(uchar *buf, i64 len)
+{
+	char words[2048][12];
+	uint32_t seed = 1234567;
+	i64 i, p = 0;
+	int w, l;
+
+#define NEXT	(seed = seed * 1103515245 + 12345, seed >> 8)
+	for (w = 0; w < 2048; w++) {
+		l = 2 + NEXT % 9;
+		for (i = 0; i < l; i++)
+			words[w][i] = 'a' + NEXT % 26;
+		words[w][l] = '\0';
+	}
+	while (p < len) {
+		if (p > 65536 && !(NEXT % 4096)) {
+			i64 from = NEXT % (p - 32768), rep = MIN(4096 + NEXT % 28672, len - p);
+
+			memcpy(buf + p, buf + from, rep);
+			p += rep;
+			continue;
+		}
+		w = (NEXT % 2048) * (NEXT % 2048) / 2048;
+		for (i = 0; words[w][i] && p < len; i++)
+			buf[p++] = words[w][i];
+		if (p < len)
+			buf[p++] = NEXT % 12 ? ' ' : '\n';
+	}
+#undef NEXT
+}
+
+static void *trial_thread(void *data)
+{
+	struct tune_trial *tt = data;
+	int i;
+
+	tt->ok = true;
+	for (i = 0; i < TUNE_BLOCKS && tt->ok; i++) {
+		uchar *buf = malloc(TUNE_BLOCK);
+
+		if (unlikely(!buf)) {
+			tt->ok = false;
+			break;
+		}
+		memcpy(buf, tt->block, TUNE_BLOCK);
+		tt->ok = trial_compress_buf(tt->control, tt->c_type, &buf, TUNE_BLOCK) >= 0;
+		dealloc(buf);
+	}
+	return NULL;
+}
+
+/* Time threads backend threads each compressing TUNE_BLOCKS blocks at once,
+ * returning the bytes per second of each */
+static double time_backend(rzip_control *control, uchar c_type, const uchar *corpus, int threads)
+{
+	struct tune_trial *tt;
+	pthread_t *pthreads;
+	double start, secs;
+	bool ok = true;
+	int i;
+
+	tt = calloc(sizeof(*tt), threads);
+	pthreads = calloc(sizeof(*pthreads), threads);
+	if (unlikely(!tt || !pthreads)) {
+		dealloc(tt);
+		dealloc(pthreads);
+		return 0;
+	}
+	start = stats_time();
+	for (i = 0; i < threads; i++) {
+		tt[i].control = control;
+		tt[i].c_type = c_type;
+		tt[i].block = corpus + (i * TUNE_BLOCK) % (TUNE_CORPUS - TUNE_BLOCK);
+		if (unlikely(!create_pthread(control, &pthreads[i], NULL, trial_thread, &tt[i]))) {
+			threads = i;
+			ok = false;
+			break;
+		}
+	}
+	for (i = 0; i < threads; i++) {
+		join_pthread(control, pthreads[i], NULL);
+		ok &= tt[i].ok;
+	}
+	secs = stats_time() - start;
+	dealloc(tt);
+	dealloc(pthreads);
+	if (!ok || secs <= 0)
+		return 0;
+	return (double)TUNE_BLOCKS * TUNE_BLOCK / secs;
+}
+
+static bool calibrate(rzip_control *control, uchar c_type, struct tune_entry *te)
+{
+	rzip_control scratch;
+	uchar *corpus;
+	double spb;
+
+	corpus = malloc(TUNE_CORPUS);
+	if (unlikely(!corpus))
+		fatal_return(("Failed to malloc corpus in calibrate\n"), false);
+	make_corpus(corpus, TUNE_CORPUS);
+
+	/* The trials must not touch the state of the real job */
+	memcpy(&scratch, control, sizeof(scratch));
+	scratch.lzma_prop_set = false;
+	scratch.lzma_threads = 1;
+	scratch.stats = NULL;
+	scratch.trace = NULL;
+	scratch.metrics = NULL;
+	scratch.throttle = NULL;
+	scratch.numa = NULL;
+	scratch.flags &= ~FLAG_SHOW_PROGRESS;
+	if (unlikely(!init_mutex(&scratch, &scratch.control_lock))) {
+		dealloc(corpus);
+		return false;
+	}
+
+	print_output("Calibrating %s level %d with %d threads for autotune...\n",
+		     te->backend, te->level, te->threads);
+	spb = rzip_sample_speed(&scratch, corpus, TUNE_CORPUS);
+	te->rzip_bps = spb > 0 ? 1 / spb : 0;
+	if (c_type != CTYPE_NONE) {
+		te->backend_bps = time_backend(&scratch, c_type, corpus, 1);
+		te->parallel_bps = te->threads > 1 ?
+			time_backend(&scratch, c_type, corpus, te->threads) : te->backend_bps;
+	}
+	pthread_mutex_destroy(&scratch.control_lock);
+	dealloc(corpus);
+	return te->rzip_bps > 0 && (c_type == CTYPE_NONE || te->parallel_bps > 0);
+}
+
+bool autotune(rzip_control *control)
+{
+	struct tune_entry te[TUNE_ENTRIES], *e = NULL;
+	char path[PATH_MAX], hwid[256];
+	int n = 0, i, budget, threads;
+	const char *backend;
+	i64 bufsize, need;
+	uchar c_type;
+
+	backend = backend_name(control, &c_type);
+	budget = control->threads;
+	hardware_id(control, hwid, sizeof(hwid));
+	if (profile_path(path, sizeof(path)))
+		n = load_profile(path, hwid, te);
+	for (i = 0; i < n; i++) {
+		if (!strcmp(te[i].backend, backend) && te[i].level == control->compression_level &&
+		    te[i].threads == budget) {
+			e = &te[i];
+			break;
+		}
+	}
+	if (!e) {
+		e = &te[n < TUNE_ENTRIES ? n++ : TUNE_ENTRIES - 1];
+		memset(e, 0, sizeof(*e));
+		snprintf(e->backend, sizeof(e->backend), "%s", backend);
+		e->level = control->compression_level;
+		e->threads = budget;
+		if (!calibrate(control, c_type, e)) {
+			print_err("Warning, autotune calibration failed, using defaults\n");
+			return true;
+		}
+		if (*path)
+			save_profile(control, path, hwid, e);
+	}
+
+	/* Only as many backend threads as it takes to keep up with rzip,
+	 * assuming the worst case where nothing is matched */
+	threads = budget;
+	if (c_type != CTYPE_NONE)
+		threads = MAX(1, MIN(budget, (int)ceil(e->rzip_bps / e->parallel_bps)));
+	control->cpu_budget = budget;
+	control->threads = threads;
+
+	bufsize = c_type == CTYPE_NONE ? STREAM_BUFSIZE : e->parallel_bps * TUNE_BLOCK_SECS;
+	control->tune_bufsize = bufsize = MAX(bufsize, STREAM_BUFSIZE);
+
+	/* Hand the ram the backend threads won't use to the main buffer */
+	need = threads * (control->overhead + 2 * bufsize);
+	if (!control->window && !UNLIMITED && !STDIN && !STDOUT && !BITS32 &&
+	    need < control->usable_ram) {
+		control->maxram += control->usable_ram - need;
+		round_to_page(&control->maxram);
+		control->usable_ram = need;
+	}
+	print_verbose("Autotune: rzip %.1fMB/s, %s level %d %.1fMB/s per thread\n",
+		      e->rzip_bps / 1048576, backend, e->level, e->parallel_bps / 1048576);
+	print_verbose("Autotune: %d of %d threads, blocks of up to %"PRId64"MB, main buffer %"PRId64"MB\n",
+		      threads, budget, bufsize >> 20, control->maxram >> 20);
+	return true;
+}
@@ -55,6 +55,7 @@
 #include "util.h"
 #include "sha4.h"
 #include "aes.h"
+#include "throttle.h"
 #ifdef HAVE_CTYPE_H
 # include <ctype.h>
 #endif
@@ -90,15 +91,9 @@ void unlink_files(rzip_control *control)
 		unlink(control->util_infile);
 }
 
-void fatal_exit(rzip_control *control)
+/* Remove the temporary files and partly written output of a job that died */
+void unlink_broken(rzip_control *control)
 {
-	struct termios termios_p;
-
-	/* Make sure we haven't died after disabling stdin echo */
-	tcgetattr(fileno(stdin), &termios_p);
-	termios_p.c_lflag |= ECHO;
-	tcsetattr(fileno(stdin), 0, &termios_p);
-
 	unlink_files(control);
 	if (!STDOUT && !TEST_ONLY && control->outfile) {
 		if (!KEEP_BROKEN) {
@@ -107,6 +102,18 @@ void fatal_exit(rzip_control *control)
 		} else
 			print_verbose("Keeping broken file %s as requested\n", control->outfile);
 	}
+}
+
+void fatal_exit(rzip_control *control)
+{
+	struct termios termios_p;
+
+	/* Make sure we haven't died after disabling stdin echo */
+	tcgetattr(fileno(stdin), &termios_p);
+	termios_p.c_lflag |= ECHO;
+	tcsetattr(fileno(stdin), 0, &termios_p);
+
+	unlink_broken(control);
 	fprintf(control->outputfile, "Fatal error - exiting\n");
 	fflush(control->outputfile);
 	exit(1);
@@ -245,6 +252,10 @@ bool read_config(rzip_control *control)
 			control->compression_level = atoi(parametervalue);
 			if ( control->compression_level < 1 || control->compression_level > 9 )
 				failure_return(("CONF.FILE error. Compression Level must between 1 and 9"), false);
+		} else if (isparameter(parameter, "minmatch")) {
+			control->min_match = atoi(parametervalue);
+			if (control->min_match < MIN_MATCH_LOW || control->min_match > MIN_MATCH_HIGH)
+				failure_return(("CONF.FILE error. Minimum match must be between 16 and 64"), false);
 		} else if (isparameter(parameter, "compressionmethod")) {
 			/* valid are rzip, gzip, bzip2, lzo, lzma (default), and zpaq */
 			if (control->flags & FLAG_NOT_LZMA)
@@ -300,6 +311,9 @@ bool read_config(rzip_control *control)
 		} else if (isparameter(parameter, "keepbroken")) {
 			if (isparameter(parametervalue, "yes" ))
 				control->flags |= FLAG_KEEP_BROKEN;
+		} else if (isparameter(parameter, "prealloc")) {
+			if (isparameter(parametervalue, "no"))
+				control->flags |= FLAG_NO_PREALLOC;
 		} else if (iscaseparameter(parameter, "DELETEFILES")) {
 			/* delete files must be case sensitive */
 			if (iscaseparameter(parametervalue, "YES"))
@@ -315,6 +329,28 @@ bool read_config(rzip_control *control)
 			strcpy(control->tmpdir, parametervalue);
 			if (strcmp(parametervalue + strlen(parametervalue) - 1, "/"))
 				strcat(control->tmpdir, "/");
+		} else if (isparameter(parameter, "readlimit")) {
+			control->read_limit = strtod(parametervalue, NULL) * 1024 * 1024;
+			if (control->read_limit <= 0)
+				failure_return(("CONF.FILE error. Read limit must be a positive MB/s"), false);
+		} else if (isparameter(parameter, "writelimit")) {
+			control->write_limit = strtod(parametervalue, NULL) * 1024 * 1024;
+			if (control->write_limit <= 0)
+				failure_return(("CONF.FILE error. Write limit must be a positive MB/s"), false);
+		} else if (isparameter(parameter, "ionice")) {
+			if (!parse_ionice(control, parametervalue))
+				failure_return(("CONF.FILE error. Ionice must be idle or best-effort[:0-7]"), false);
+		} else if (isparameter(parameter, "cpulimit")) {
+			control->cpu_limit = atoi(parametervalue);
+			if (control->cpu_limit < 1 || control->cpu_limit > 100)
+				failure_return(("CONF.FILE error. CPU limit must be between 1 and 100"), false);
+		} else if (isparameter(parameter, "autotune")) {
+			if (isparameter(parametervalue, "yes"))
+				control->flags |= FLAG_AUTOTUNE;
+		} else if (isparameter(parameter, "jobs")) {
+			control->jobs = atoi(parametervalue);
+			if (control->jobs < 0)
+				failure_return(("CONF.FILE error. Jobs must be 0 or more"), false);
 		} else if (isparameter(parameter, "encrypt")) {
 			if (isparameter(parameter, "YES"))
 				control->flags |= FLAG_ENCRYPT;
@@ -29,6 +29,7 @@
 void register_infile(rzip_control *control, const char *name, char delete);
 void register_outfile(rzip_control *control, const char *name, char delete);
 void unlink_files(rzip_control *control);
+void unlink_broken(rzip_control *control);
 void register_outputfile(rzip_control *control, FILE *f);
 void fatal_exit(rzip_control *control);
 /* Failure when there is likely to be a meaningful error in perror */